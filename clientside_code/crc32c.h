@@ -0,0 +1,147 @@
+/*
+ * crc32c.h - CRC32C (Castagnoli) for payload integrity checks
+ *
+ * The same file lives in clientside_code/ and serverside_code/; keep the
+ * two copies identical.
+ *
+ * crc32c_init() picks an implementation once and must run before the
+ * first crc32c_update(). A running CRC starts from crc32c_begin(), is fed
+ * any number of buffers with crc32c_update() and closed with
+ * crc32c_end(), so the value can be built up as a payload arrives.
+ *
+ *   x86-64   SSE4.2 crc32 instruction, chosen at run time
+ *   ARM      ARMv8 crc32c instructions when the compiler targets them
+ *            (e.g. -march=armv8-a+crc on the Pi)
+ *   other    slicing-by-8 tables
+ */
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78 // reflected Castagnoli polynomial
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *p, size_t len);
+static const char *crc32c_name = "none";
+
+/* slicing-by-8: eight table lookups per 8 bytes, no carried dependency between them */
+static uint32_t crc32c_sliced(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len && ((uintptr_t)p & 7)) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc; // little endian: the first four bytes fold into the CRC
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c = crc;
+    while (len && ((uintptr_t)p & 7)) {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    return (uint32_t)c;
+}
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len && ((uintptr_t)p & 3)) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+#if defined(__aarch64__)
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+#endif
+    while (len >= 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        crc = __crc32cw(crc, v);
+        p += 4;
+        len -= 4;
+    }
+    while (len--)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#endif
+
+static inline void crc32c_init(void) {
+    uint32_t c;
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32c_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++)
+        for (k = 1; k < 8; k++)
+            crc32c_table[k][i] = crc32c_table[0][crc32c_table[k - 1][i] & 0xff] ^ (crc32c_table[k - 1][i] >> 8);
+    crc32c_impl = crc32c_sliced;
+    crc32c_name = "slicing-by-8";
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = crc32c_sse42;
+        crc32c_name = "sse4.2";
+    }
+#elif defined(__ARM_FEATURE_CRC32)
+    crc32c_impl = crc32c_armv8;
+    crc32c_name = "armv8 crc";
+#endif
+}
+
+static inline uint32_t crc32c_begin(void) {
+    return 0xffffffff;
+}
+
+static inline uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len) {
+    return crc32c_impl(crc, buf, len);
+}
+
+static inline uint32_t crc32c_end(uint32_t crc) {
+    return crc ^ 0xffffffff;
+}
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ * estimator.h - latency estimators shared by tcpclient and its tools
+ *
+ * Each estimator predicts the next latency sample (pred) and an upper
+ * bound on it (up). Before a sample is folded in, the prediction error
+ * and whether the sample stayed under the bound are recorded, so every
+ * configuration running on the same samples can be compared directly.
+ *
+ * Estimators are built from a spec string "name[:p1[:p2[:p3]]]":
+ *   jk:alpha:beta:kappa   Jacobson/Karels in fixed point (default 0.125:0.25:4)
+ *   ewma:alpha:kappa      plain EWMA, bound is kappa times the mean (default 0.125:1.5)
+ *   min:window            windowed min filter, bound is the window max (default 16)
+ *   kalman:q:r:kappa      1-D Kalman filter, q/r in s^2 (default 1e-6:1e-4:2)
+ */
+#ifndef ESTIMATOR_H
+#define ESTIMATOR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#define EST_MAX 8          // estimators running side by side
+#define EST_WINDOW_MAX 256 // largest min-filter window
+#define JK_FRAC 16         // fixed-point fraction bits for gains
+#define JK_SCALE 256       // latency is kept in microseconds * JK_SCALE
+
+typedef struct estimator estimator;
+
+typedef struct{
+    const char *name;
+    double defaults[3];
+    void (*first)(estimator *e, double sample);  // seed the state from the first sample
+    void (*update)(estimator *e, double sample); // fold a sample in, refresh pred/up
+} est_ops;
+
+struct estimator{
+    const est_ops *ops;
+    char spec[64];          // spec with every parameter filled in
+    double p[3];
+    int primed;             // 0 until the first sample
+    double pred, up;        // prediction and upper bound for the next sample, seconds
+
+    // prediction error of every sample after the first
+    unsigned long n, covered;
+    double sum_abs, sum_sq;
+    double last_err;
+
+    union{
+        struct{ int64_t srtt, rttvar, alpha, beta, kappa; } jk;
+        struct{ double mean; } ewma;
+        struct{
+            // monotonic deques of sample indices into ring, for the min and the max
+            double ring[EST_WINDOW_MAX];
+            unsigned long lo[EST_WINDOW_MAX], hi[EST_WINDOW_MAX];
+            unsigned long lo_head, lo_tail, hi_head, hi_tail, count;
+            int window;
+        } win;
+        struct{ double x, P; } kf;
+    } s;
+};
+
+/* Jacobson/Karels: integer arithmetic on microseconds, gains in Q16 */
+static void jk_publish(estimator *e) {
+    e->pred = e->s.jk.srtt / (1e6 * JK_SCALE);
+    e->up = (e->s.jk.srtt + ((e->s.jk.rttvar * e->s.jk.kappa) >> JK_FRAC)) / (1e6 * JK_SCALE);
+}
+
+static void jk_first(estimator *e, double sample) {
+    e->s.jk.alpha = (int64_t)(e->p[0] * (1 << JK_FRAC));
+    e->s.jk.beta = (int64_t)(e->p[1] * (1 << JK_FRAC));
+    e->s.jk.kappa = (int64_t)(e->p[2] * (1 << JK_FRAC));
+    e->s.jk.srtt = (int64_t)(sample * 1e6 * JK_SCALE);
+    e->s.jk.rttvar = e->s.jk.srtt / 2;
+    jk_publish(e);
+}
+
+static void jk_update(estimator *e, double sample) {
+    int64_t y = (int64_t)(sample * 1e6 * JK_SCALE);
+    int64_t err = y - e->s.jk.srtt;
+    int64_t dev = err < 0 ? -err : err;
+    e->s.jk.rttvar += ((dev - e->s.jk.rttvar) * e->s.jk.beta) >> JK_FRAC;
+    e->s.jk.srtt += (err * e->s.jk.alpha) >> JK_FRAC;
+    jk_publish(e);
+}
+
+static void ewma_first(estimator *e, double sample) {
+    e->s.ewma.mean = sample;
+    e->pred = sample;
+    e->up = e->p[1] * sample;
+}
+
+static void ewma_update(estimator *e, double sample) {
+    e->s.ewma.mean += e->p[0] * (sample - e->s.ewma.mean);
+    e->pred = e->s.ewma.mean;
+    e->up = e->p[1] * e->s.ewma.mean;
+}
+
+/* windowed min filter: O(1) amortised per sample with two monotonic deques */
+static void win_update(estimator *e, double sample) {
+    unsigned long i = e->s.win.count++;
+    unsigned long w = e->s.win.window;
+
+    // drop the index falling out of the window before its ring slot is reused
+    if (e->s.win.lo_tail > e->s.win.lo_head && e->s.win.lo[e->s.win.lo_head % w] + w <= i)
+        e->s.win.lo_head++;
+    if (e->s.win.hi_tail > e->s.win.hi_head && e->s.win.hi[e->s.win.hi_head % w] + w <= i)
+        e->s.win.hi_head++;
+    e->s.win.ring[i % w] = sample;
+    while (e->s.win.lo_tail > e->s.win.lo_head &&
+           e->s.win.ring[e->s.win.lo[(e->s.win.lo_tail - 1) % w] % w] >= sample)
+        e->s.win.lo_tail--;
+    e->s.win.lo[e->s.win.lo_tail++ % w] = i;
+    while (e->s.win.hi_tail > e->s.win.hi_head &&
+           e->s.win.ring[e->s.win.hi[(e->s.win.hi_tail - 1) % w] % w] <= sample)
+        e->s.win.hi_tail--;
+    e->s.win.hi[e->s.win.hi_tail++ % w] = i;
+    e->pred = e->s.win.ring[e->s.win.lo[e->s.win.lo_head % w] % w];
+    e->up = e->s.win.ring[e->s.win.hi[e->s.win.hi_head % w] % w];
+}
+
+static void win_first(estimator *e, double sample) {
+    int w = (int)e->p[0];
+    e->s.win.window = w < 1 ? 1 : w > EST_WINDOW_MAX ? EST_WINDOW_MAX : w;
+    e->s.win.lo_head = e->s.win.lo_tail = 0;
+    e->s.win.hi_head = e->s.win.hi_tail = 0;
+    e->s.win.count = 0;
+    win_update(e, sample);
+}
+
+/* 1-D Kalman filter on a random-walk latency */
+static void kf_first(estimator *e, double sample) {
+    e->s.kf.x = sample;
+    e->s.kf.P = e->p[1];
+    e->pred = sample;
+    e->up = sample + e->p[2] * sqrt(e->s.kf.P + e->p[1]);
+}
+
+static void kf_update(estimator *e, double sample) {
+    double P = e->s.kf.P + e->p[0];
+    double K = P / (P + e->p[1]);
+    e->s.kf.x += K * (sample - e->s.kf.x);
+    e->s.kf.P = (1 - K) * P;
+    e->pred = e->s.kf.x;
+    e->up = e->s.kf.x + e->p[2] * sqrt(e->s.kf.P + e->p[0] + e->p[1]);
+}
+
+static const est_ops est_table[] = {
+    { "jk",     { 0.125, 0.25, 4 }, jk_first,   jk_update },
+    { "ewma",   { 0.125, 1.5, 0 },  ewma_first, ewma_update },
+    { "min",    { 16, 0, 0 },       win_first,  win_update },
+    { "kalman", { 1e-6, 1e-4, 2 },  kf_first,   kf_update },
+};
+
+/* est_init - build an estimator from a spec string; -1 if the spec is bad */
+static inline int est_init(estimator *e, const char *spec) {
+    char name[16];
+    size_t len = strcspn(spec, ":");
+    const char *p = spec + len;
+    unsigned k;
+    int i;
+
+    memset(e, 0, sizeof(*e));
+    if (len == 0 || len >= sizeof(name))
+        return -1;
+    memcpy(name, spec, len);
+    name[len] = '\0';
+    for (k = 0; k < sizeof(est_table)/sizeof(est_table[0]); k++)
+        if (strcmp(name, est_table[k].name) == 0)
+            e->ops = &est_table[k];
+    if (e->ops == NULL)
+        return -1;
+    for (i = 0; i < 3; i++) {
+        e->p[i] = e->ops->defaults[i];
+        if (*p == ':') {
+            char *end;
+            e->p[i] = strtod(p + 1, &end);
+            if (end == p + 1)
+                return -1;
+            p = end;
+        }
+    }
+    if (*p != '\0')
+        return -1;
+    snprintf(e->spec, sizeof(e->spec), "%s:%g:%g:%g", name, e->p[0], e->p[1], e->p[2]);
+    return 0;
+}
+
+/* est_sample - score the standing prediction against sample, then learn from it */
+static inline void est_sample(estimator *e, double sample) {
+    if (!e->primed) {
+        e->ops->first(e, sample);
+        e->primed = 1;
+        e->last_err = 0;
+        return;
+    }
+    e->last_err = sample - e->pred;
+    e->n++;
+    e->sum_abs += fabs(e->last_err);
+    e->sum_sq += e->last_err * e->last_err;
+    if (sample <= e->up)
+        e->covered++;
+    e->ops->update(e, sample);
+}
+
+/* est_report - one line summary of prediction error and bound coverage */
+static inline void est_report(FILE *fp, const estimator *e) {
+    if (e->n == 0) {
+        fprintf(fp, "%-28s no predictions yet\n", e->spec);
+        return;
+    }
+    fprintf(fp, "%-28s mae %.6f rmse %.6f coverage %.1f%% (%lu samples)\n", e->spec,
+            e->sum_abs / e->n, sqrt(e->sum_sq / e->n), 100.0 * e->covered / e->n, e->n);
+}
+
+#endif
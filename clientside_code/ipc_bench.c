@@ -0,0 +1,413 @@
+/*
+ * ipc_bench.c - compare ways of handing the clock offset to other processes
+ * usage: ipc_bench [-r readers] [-n messages] [-i us] [-p us] [mechanism]...
+ *   -r  reader processes (default 4)
+ *   -n  offsets published per mechanism (default 10000)
+ *   -i  microseconds between publishes, 0 for as fast as possible (default 1000)
+ *   -p  microseconds polling readers sleep between looks, 0 to spin
+ *       with sched_yield (default 0)
+ *
+ * One writer publishes records {seq, publish time, offset} and every reader
+ * records how long after the publish it saw each one. The mechanisms are
+ *   file     what udpclient and tcpclient do today: the writer stores into
+ *            a mapped file and msyncs it, the reader opens, maps, reads and
+ *            unmaps it on every look; there is nothing to stop a torn read
+ *   shm      a POSIX shared memory segment guarded by a seqlock; readers
+ *            poll it without a system call
+ *   pipe     one pipe per reader, the writer writes the record into each
+ *   unix     one AF_UNIX datagram socket pair per reader, likewise
+ *   eventfd  the shm seqlock plus one eventfd per reader that the writer
+ *            bumps after each publish, so readers sleep until there is
+ *            news (Linux only)
+ * All mechanisms run by default. Polling readers only see the latest
+ * record, so with a short -i they miss some; the report counts them.
+ * Publish and observe times both come from CLOCK_MONOTONIC, which every
+ * process shares.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#define MAX_READERS 64
+#define BENCH_FILE "ipc_bench.dat"
+#define BENCH_SHM "/ipc_bench"
+
+typedef struct{
+    uint64_t seq;      // 1, 2, ... n
+    uint64_t t_pub;    // CLOCK_MONOTONIC ns at publish
+    double offset;
+} record;
+
+/* seqlock: seq is odd while the writer is inside; fields are atomics so readers may race them */
+typedef struct{
+    _Atomic uint64_t seq;
+    _Atomic uint64_t rec_seq, t_pub, offset_bits;
+} seqlock;
+
+/* filled in by the readers, read by the writer after they exit */
+typedef struct{
+    _Atomic int ready;
+    unsigned long count[MAX_READERS];
+    uint64_t retries[MAX_READERS]; // seqlock re-reads
+    uint32_t lat[];                // readers x n latencies, ns
+} shared_results;
+
+typedef enum{ MECH_FILE, MECH_SHM, MECH_PIPE, MECH_UNIX, MECH_EVENTFD } mechanism;
+
+static const char *mech_names[] = { "file", "shm", "pipe", "unix", "eventfd" };
+
+static int nreaders = 4, poll_us = 0;
+static unsigned long nmsgs = 10000;
+static long interval_us = 1000;
+
+/*
+ * error - wrapper for perror
+ */
+void error(char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void seq_write(seqlock *s, const record *r) {
+    uint64_t bits, seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+
+    memcpy(&bits, &r->offset, sizeof(bits));
+    atomic_store_explicit(&s->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&s->rec_seq, r->seq, memory_order_relaxed);
+    atomic_store_explicit(&s->t_pub, r->t_pub, memory_order_relaxed);
+    atomic_store_explicit(&s->offset_bits, bits, memory_order_relaxed);
+    atomic_store_explicit(&s->seq, seq + 2, memory_order_release);
+}
+
+/* seq_read - copy a consistent record out; returns how many times it had to retry */
+static uint64_t seq_read(seqlock *s, record *r) {
+    uint64_t s1, s2, bits, retries = 0;
+
+    for (;;) {
+        s1 = atomic_load_explicit(&s->seq, memory_order_acquire);
+        if (!(s1 & 1)) {
+            r->seq = atomic_load_explicit(&s->rec_seq, memory_order_relaxed);
+            r->t_pub = atomic_load_explicit(&s->t_pub, memory_order_relaxed);
+            bits = atomic_load_explicit(&s->offset_bits, memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            s2 = atomic_load_explicit(&s->seq, memory_order_relaxed);
+            if (s1 == s2)
+                break;
+        }
+        retries++;
+    }
+    memcpy(&r->offset, &bits, sizeof(bits));
+    return retries;
+}
+
+/* file_look - read the record the way get_offset() in tcpclient reads result.txt */
+static void file_look(record *r) {
+    int fd = open(BENCH_FILE, O_RDONLY);
+    record *map;
+
+    if (fd == -1)
+        error("Error opening " BENCH_FILE);
+    map = mmap(0, sizeof(record), PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        error("Error mmapping " BENCH_FILE);
+    *r = *map;
+    munmap(map, sizeof(record));
+    close(fd);
+}
+
+static void idle(void) {
+    if (poll_us > 0)
+        usleep(poll_us);
+    else
+        sched_yield();
+}
+
+/*
+ * reader - observe records until the last one, logging each new one's
+ * latency; fd is the reader's pipe, socket or eventfd, if any
+ */
+static void reader(mechanism mech, int id, int fd, seqlock *s, shared_results *res) {
+    uint32_t *lat = res->lat + (size_t)id * nmsgs;
+    unsigned long count = 0;
+    uint64_t last = 0, retries = 0, v;
+    record r;
+    ssize_t n;
+
+    atomic_fetch_add(&res->ready, 1);
+    while (last < nmsgs) {
+        switch (mech) {
+        case MECH_FILE:
+            file_look(&r);
+            break;
+        case MECH_SHM:
+            retries += seq_read(s, &r);
+            break;
+        case MECH_PIPE:
+        case MECH_UNIX:
+            n = read(fd, &r, sizeof(r));
+            if (n != sizeof(r))
+                error("Error reading a record");
+            break;
+        case MECH_EVENTFD:
+            if (read(fd, &v, sizeof(v)) != sizeof(v))
+                error("Error reading the eventfd");
+            retries += seq_read(s, &r);
+            break;
+        }
+        if (r.seq == last) {
+            idle();
+            continue;
+        }
+        uint64_t t_obs = mono_ns();
+        if (count < nmsgs)
+            lat[count++] = (uint32_t)(t_obs - r.t_pub < UINT32_MAX ? t_obs - r.t_pub : UINT32_MAX);
+        last = r.seq;
+    }
+    res->count[id] = count;
+    res->retries[id] = retries;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* run - fork the readers, publish nmsgs records through mech and report */
+static void run(mechanism mech) {
+    size_t res_size = sizeof(shared_results) + (size_t)nreaders * nmsgs * sizeof(uint32_t);
+    shared_results *res;
+    seqlock *s = NULL;
+    record *file_map = NULL;
+    int fds[MAX_READERS][2];
+    pid_t pids[MAX_READERS];
+    struct timespec next;
+    uint64_t t0, t1, retries = 0;
+    unsigned long seq, total = 0;
+    size_t i, k;
+    int r, fd;
+
+    res = mmap(0, res_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (res == MAP_FAILED)
+        error("Error mapping the results");
+    memset(res, 0, sizeof(shared_results));
+
+    if (mech == MECH_FILE) {
+        fd = open(BENCH_FILE, O_RDWR | O_CREAT | O_TRUNC, (mode_t)0600);
+        if (fd == -1)
+            error("Error opening " BENCH_FILE);
+        if (ftruncate(fd, sizeof(record)) == -1)
+            error("Error sizing " BENCH_FILE);
+        file_map = mmap(0, sizeof(record), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (file_map == MAP_FAILED)
+            error("Error mmapping " BENCH_FILE);
+        close(fd);
+    }
+    if (mech == MECH_SHM || mech == MECH_EVENTFD) {
+        shm_unlink(BENCH_SHM); // left behind by a run that was killed
+        fd = shm_open(BENCH_SHM, O_RDWR | O_CREAT | O_EXCL, (mode_t)0600);
+        if (fd == -1)
+            error("Error opening the shm segment");
+        if (ftruncate(fd, sizeof(seqlock)) == -1)
+            error("Error sizing the shm segment");
+        s = mmap(0, sizeof(seqlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (s == MAP_FAILED)
+            error("Error mmapping the shm segment");
+        close(fd);
+        shm_unlink(BENCH_SHM); // the mapping outlives the name
+    }
+
+    for (r = 0; r < nreaders; r++) {
+        switch (mech) {
+        case MECH_PIPE:
+            if (pipe(fds[r]) == -1)
+                error("Error creating a pipe");
+            break;
+        case MECH_UNIX:
+            if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds[r]) == -1)
+                error("Error creating a socket pair");
+            break;
+#ifdef __linux__
+        case MECH_EVENTFD:
+            fds[r][0] = fds[r][1] = eventfd(0, 0);
+            if (fds[r][0] == -1)
+                error("Error creating an eventfd");
+            break;
+#endif
+        default:
+            fds[r][0] = fds[r][1] = -1;
+        }
+        pids[r] = fork();
+        if (pids[r] == -1)
+            error("Error forking a reader");
+        if (pids[r] == 0) {
+            if (mech == MECH_PIPE || mech == MECH_UNIX)
+                close(fds[r][1]);
+            reader(mech, r, fds[r][0], s, res);
+            _exit(0);
+        }
+        if (mech == MECH_PIPE || mech == MECH_UNIX)
+            close(fds[r][0]);
+    }
+    while (atomic_load(&res->ready) < nreaders)
+        sched_yield();
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    t0 = mono_ns();
+    for (seq = 1; seq <= nmsgs; seq++) {
+        record rec = { seq, mono_ns(), seq * 1e-6 };
+        uint64_t one = 1;
+        switch (mech) {
+        case MECH_FILE:
+            *file_map = rec;
+            if (msync(file_map, sizeof(record), MS_SYNC) == -1)
+                perror("Could not sync the file to disk");
+            break;
+        case MECH_SHM:
+            seq_write(s, &rec);
+            break;
+        case MECH_PIPE:
+        case MECH_UNIX:
+            for (r = 0; r < nreaders; r++)
+                if (write(fds[r][1], &rec, sizeof(rec)) != sizeof(rec))
+                    error("Error writing a record");
+            break;
+        case MECH_EVENTFD:
+            seq_write(s, &rec);
+            for (r = 0; r < nreaders; r++)
+                if (write(fds[r][1], &one, sizeof(one)) != sizeof(one))
+                    error("Error signalling the eventfd");
+            break;
+        }
+        if (interval_us > 0) {
+            next.tv_nsec += interval_us * 1000;
+            while (next.tv_nsec >= 1000000000L) {
+                next.tv_sec++;
+                next.tv_nsec -= 1000000000L;
+            }
+#ifdef __linux__
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+                ;
+#else
+            int64_t left = (int64_t)next.tv_sec * 1000000000LL + next.tv_nsec - (int64_t)mono_ns();
+            if (left > 0)
+                usleep((useconds_t)(left / 1000));
+#endif
+        }
+    }
+    t1 = mono_ns();
+    for (r = 0; r < nreaders; r++) {
+        waitpid(pids[r], NULL, 0);
+        if (mech == MECH_PIPE || mech == MECH_UNIX || mech == MECH_EVENTFD)
+            close(fds[r][1]);
+    }
+
+    // gather every reader's latencies into one run for the percentiles
+    for (r = 0; r < nreaders; r++) {
+        memmove(res->lat + total, res->lat + (size_t)r * nmsgs, res->count[r] * sizeof(uint32_t));
+        total += res->count[r];
+        retries += res->retries[r];
+    }
+    qsort(res->lat, total, sizeof(uint32_t), compare_u32);
+    if (total == 0) {
+        printf("%-8s nothing observed\n", mech_names[mech]);
+    } else {
+        k = total - 1;
+        i = total / 2;
+        printf("%-8s %9.1f %9.1f %9.1f %9.1f %11.0f %7.1f%% %9llu\n", mech_names[mech],
+               res->lat[i] / 1e3, res->lat[total * 90 / 100] / 1e3, res->lat[total * 99 / 100] / 1e3,
+               res->lat[k] / 1e3, nmsgs / ((t1 - t0) / 1e9),
+               100.0 * (1 - (double)total / ((double)nmsgs * nreaders)), (unsigned long long)retries);
+    }
+
+    munmap(res, res_size);
+    if (file_map != NULL) {
+        munmap(file_map, sizeof(record));
+        unlink(BENCH_FILE);
+    }
+    if (s != NULL)
+        munmap(s, sizeof(seqlock));
+}
+
+int main(int argc, char **argv) {
+    int run_mech[5] = { 0 }, any = 0;
+    int opt, i, m;
+
+    while ((opt = getopt(argc, argv, "r:n:i:p:")) != -1) {
+        switch (opt) {
+        case 'r':
+            nreaders = atoi(optarg);
+            break;
+        case 'n':
+            nmsgs = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            interval_us = atol(optarg);
+            break;
+        case 'p':
+            poll_us = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r readers] [-n messages] [-i us] [-p us] [mechanism]...\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (nreaders < 1 || nreaders > MAX_READERS || nmsgs < 1 || interval_us < 0 || poll_us < 0) {
+        fprintf(stderr, "usage: %s [-r readers] [-n messages] [-i us] [-p us] [mechanism]...\n", argv[0]);
+        exit(1);
+    }
+    for (i = optind; i < argc; i++) {
+        for (m = 0; m < 5; m++)
+            if (strcmp(argv[i], mech_names[m]) == 0)
+                break;
+        if (m == 5) {
+            fprintf(stderr, "unknown mechanism %s, want file, shm, pipe, unix or eventfd\n", argv[i]);
+            exit(1);
+        }
+        run_mech[m] = any = 1;
+    }
+#ifndef __linux__
+    if (run_mech[MECH_EVENTFD]) {
+        fprintf(stderr, "eventfd is Linux only\n");
+        exit(1);
+    }
+#endif
+    // a reader that dies mid-run must not take the writer down with SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%d readers, %lu publishes, interval %ld us, %s polling\n", nreaders, nmsgs, interval_us,
+           poll_us > 0 ? "sleeping" : "spinning");
+    printf("%-8s %9s %9s %9s %9s %11s %8s %9s\n", "", "p50 us", "p90 us", "p99 us", "max us",
+           "publish/s", "missed", "retries");
+    for (m = 0; m < 5; m++) {
+#ifndef __linux__
+        if (m == MECH_EVENTFD && !any)
+            continue;
+#endif
+        if (run_mech[m] || !any)
+            run((mechanism)m);
+    }
+    return 0;
+}
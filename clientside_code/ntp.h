@@ -0,0 +1,669 @@
+/*
+ * ntp.h - NTP packet and offset estimation shared by udpclient and syncd
+ *
+ * Holds the packet layout, the per-round arena, the selection,
+ * clustering and combining algorithms that turn a round of samples into
+ * one offset, the clock filter in front of them, the drift fit and the
+ * Kalman filter across rounds, and the kernel receive time-stamp helpers.
+ */
+#ifndef NTP_H
+#define NTP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Standard NTP packet, not necessary though */
+typedef struct{
+    uint8_t li_vn_mode;      // Eight bits. li (2 bits, leap indicator), vn (3 bits, version number)
+                             // and mode (3 bits, 3 for client, 4 for server).
+    
+    uint8_t stratum;         // Eight bits. Stratum level of the local clock, 0 for Kiss-o'-Death.
+    uint8_t poll;            // Eight bits. Maximum interval between successive messages.
+    uint8_t precision;       // Eight bits. Precision of the local clock.
+    
+    uint32_t rootDelay;      // 32 bits. Total round trip delay time.
+    uint32_t rootDispersion; // 32 bits. Max error aloud from primary clock source.
+    uint32_t refId;          // 32 bits. Reference clock identifier, or the Kiss-o'-Death code.
+    
+    uint32_t refTm_s;        // 32 bits. Reference time-stamp seconds.
+    uint32_t refTm_f;        // 32 bits. Reference time-stamp fraction of a second.
+    
+    uint32_t origTm_s;       // 32 bits. Originate time-stamp seconds.
+    uint32_t origTm_f;       // 32 bits. Originate time-stamp fraction of a second.
+    
+    uint32_t rxTm_s;         // 32 bits. Received time-stamp seconds.
+    uint32_t rxTm_f;         // 32 bits. Received time-stamp fraction of a second.
+    
+    uint32_t txTm_s;         // 32 bits and the most important field the client cares about. Transmit time-stamp seconds.
+    uint32_t txTm_f;         // 32 bits. Transmit time-stamp fraction of a second.
+
+    uint32_t prevOrigTm_s;   // 32 bits. Interleaved mode: originate time-stamp of the previous exchange, seconds.
+    uint32_t prevOrigTm_f;   // 32 bits. Interleaved mode: originate time-stamp of the previous exchange, fraction.
+    uint32_t prevTxTm_s;     // 32 bits. Interleaved mode: actual transmit time-stamp of the previous reply, seconds.
+    uint32_t prevTxTm_f;     // 32 bits. Interleaved mode: actual transmit time-stamp of the previous reply, fraction.
+
+    uint32_t residence_ns;   // 32 bits. Server time from receiving the request to sending the reply, ns.
+    uint32_t wake_ns;        // 32 bits. Server time from the kernel receive stamp to the worker seeing the request, ns.
+} ntp_packet;                // Total: 576 bits or 72 bytes, the NTP header, the interleaved extension and the residence report.
+
+#define NTP_VERSION 4
+#define NTP_MODE_CLIENT 3
+#define NTP_MODE_SERVER 4
+#define NTP_LI_ALARM 3       // leap indicator: clock not synchronised
+#define NTP_STRATUM_MAX 16   // stratum 16 and up means unsynchronised
+#define KOD_RATE 0x52415445  // "RATE"
+#define POLL_MIN 5           // seconds between rounds
+#define POLL_MAX 320
+#define KOD_RECOVER 32       // replies without a RATE kiss before one back-off is undone
+#define NTP_PHI 15e-6        // assumed worst-case frequency error of the local clock, s/s
+
+/* NTP short format: 16.16 fixed-point seconds in network order */
+static inline uint32_t ntp_short(double seconds) {
+    return htonl((uint32_t)(seconds * 65536.0));
+}
+
+static inline double ntp_short_seconds(uint32_t value) {
+    return ntohl(value) / 65536.0;
+}
+
+/* ntp_unsynchronised - 1 if a reply has no time to give: a kiss, stratum 16 or the alarm leap indicator */
+static inline int ntp_unsynchronised(const ntp_packet *packet) {
+    return packet->stratum == 0 || packet->stratum >= NTP_STRATUM_MAX ||
+           (packet->li_vn_mode >> 6) == NTP_LI_ALARM;
+}
+
+/*
+ * ntp_sample_bounds - the interval one sample puts the offset in: half the
+ * round trip either side, widened by the server's own root dispersion so a
+ * relay's error bound carries through to ours.
+ */
+static inline void ntp_sample_bounds(const ntp_packet *packet, double offset, double rtt, double *l, double *u) {
+    double root_disp = ntp_short_seconds(packet->rootDispersion);
+    *l = offset - rtt/2 - root_disp;
+    *u = offset + rtt/2 + root_disp;
+}
+
+/* endpoint */
+typedef struct{
+    unsigned type : 2; // 2 bits, 0 - lowpoint, 1 - midpoint, 2 - highpoint
+    double value; // The value of the end point;
+} ntp_point;
+
+typedef struct{
+    double l;
+    double u;
+    double deviation;
+} ntp_survivor;
+
+/*
+ * Arena holding every per-round buffer. It is mapped once at startup,
+ * sized from m, and carved up before the first round so the sampling
+ * loop itself never allocates.
+ */
+typedef struct{
+    char *base;
+    size_t size;  // bytes mapped
+    size_t used;  // bytes handed out
+    int huge;     // 1 if the mapping is backed by huge pages
+} ntp_arena;
+
+#define ARENA_ALIGN 64
+#define NTP_M_MAX 1000000 // samples per round; keeps every size worked out from m in range
+#define HUGE_PAGE_SIZE (2UL*1024*1024)
+
+/* map the arena, trying huge pages first if asked to */
+static inline void arena_init(ntp_arena *a, size_t size, int want_huge) {
+    a->base = MAP_FAILED;
+    a->used = 0;
+    a->huge = 0;
+#ifdef MAP_HUGETLB
+    if (want_huge) {
+        a->size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        a->base = mmap(0, a->size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (a->base != MAP_FAILED)
+            a->huge = 1;
+        else
+            fprintf(stderr, "arena: no huge pages available, using normal pages\n");
+    }
+#endif
+    if (a->base == MAP_FAILED) {
+        a->size = size;
+        a->base = mmap(0, a->size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (a->base == MAP_FAILED) {
+            perror("Error mapping the sample arena");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Touch every page now rather than faulting them in during a round
+    memset(a->base, 0, a->size);
+}
+
+/* hand out the next cache-line aligned block of the arena */
+static inline void *arena_alloc(ntp_arena *a, size_t bytes) {
+    size_t start = (a->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (start + bytes > a->size) {
+        fprintf(stderr, "arena: out of space (%zu of %zu bytes used)\n", a->used, a->size);
+        exit(EXIT_FAILURE);
+    }
+    a->used = start + bytes;
+    return a->base + start;
+}
+
+/* worst-case arena footprint for a round of m <= NTP_M_MAX samples, alignment slack included */
+static inline size_t arena_bytes(size_t m) {
+    return 3*m*sizeof(ntp_point) + 3*m*sizeof(ntp_point)   // endpoints + sort scratch
+         + 3*m*sizeof(ntp_survivor)                        // candidates, survivors, sort scratch
+         + 8*ARENA_ALIGN;
+}
+
+/*
+ * Bottom-up merge sort on caller-provided scratch of the same size.
+ * Used instead of qsort because glibc's qsort mallocs a temporary
+ * buffer once the array passes a few hundred bytes.
+ */
+static void sort_scratch(void *base, size_t n, size_t sz, void *scratch,
+                  int (*cmp)(const void *, const void *)) {
+    char *src = base, *dst = scratch, *tmp;
+    size_t width, lo, mid, hi, i, j, k;
+
+    for (width = 1; width < n; width *= 2) {
+        for (lo = 0; lo < n; lo += 2*width) {
+            mid = lo + width < n ? lo + width : n;
+            hi = lo + 2*width < n ? lo + 2*width : n;
+            i = lo; j = mid; k = lo;
+            while (i < mid && j < hi) {
+                if (cmp(src + j*sz, src + i*sz) < 0)
+                    memcpy(dst + (k++)*sz, src + (j++)*sz, sz);
+                else
+                    memcpy(dst + (k++)*sz, src + (i++)*sz, sz);
+            }
+            memcpy(dst + k*sz, src + i*sz, (mid - i)*sz);
+            k += mid - i;
+            memcpy(dst + k*sz, src + j*sz, (hi - j)*sz);
+        }
+        tmp = src; src = dst; dst = tmp;
+    }
+    if (src != base)
+        memcpy(base, src, n*sz);
+}
+
+/* compare function for qsort in selection algorithm*/
+static int compare_select(const void *p1, const void *p2) {
+    ntp_point *c1 = (ntp_point *) p1;
+    ntp_point *c2 = (ntp_point *) p2;
+    if(c1->value < c2->value)
+	return -1;
+    else if(c1->value > c2->value)
+	return 1;
+    else
+	return 0;
+}
+
+/* compare function for qsort in clustering algorithm */
+static int compare_cluster(const void *s1, const void *s2) {
+    ntp_survivor *c1 = (ntp_survivor *) s1;
+    ntp_survivor *c2 = (ntp_survivor *) s2;
+    if(c1->deviation < c2->deviation)
+        return -1;
+    else if(c1->deviation > c2->deviation)
+        return 1;
+    else
+        return 0;
+}
+
+/* function used to get deviation of each target survivor */
+static double find_deviation(ntp_survivor *s,int target, int len){
+    int i;
+    double sum = 0;
+    for(i = 0; i < len; i++){
+        sum += pow(((s[target].l+s[target].u)/2.0 - (s[i].l+s[i].u)/2.0), 2);
+    }
+    
+    return sqrt(sum/(len - 1));
+}
+
+/* ntp_endpoints - lay out the 3m end and mid points of m intervals for selection */
+static inline void ntp_endpoints(ntp_point *endpoints, const ntp_survivor *candidates, int m) {
+    int i;
+
+    for (i = 0; i < m; i++) {
+        endpoints[i].type = 0;
+        endpoints[i].value = candidates[i].l;
+        endpoints[i+m].type = 1;
+        endpoints[i+m].value = (candidates[i].l + candidates[i].u) / 2;
+        endpoints[i+2*m].type = 2;
+        endpoints[i+2*m].value = candidates[i].u;
+    }
+}
+
+/*
+ * Clock filter: a shift register of the server's latest samples, from
+ * which only the keep narrowest intervals go on to selection. A sample's
+ * width is its round trip plus the server's dispersion, so the narrowest
+ * are the ones that queued least on the way. Samples from earlier rounds
+ * are moved along the drift when one is known and widened by NTP_PHI for
+ * their age, so a quiet old sample wins over a congested new one only
+ * while it is still the better bound.
+ *
+ * That suits combining, which starts afresh every round. A consumer that
+ * accumulates what it is fed, like the Kalman filter, must see each
+ * measurement once: it picks with consume set, which as in NTP only
+ * considers samples newer than the newest one already passed on.
+ */
+#define FILTER_STAGES_MAX 64
+
+typedef struct{
+    double t;    // local time the sample was taken
+    double l, u; // its correctness interval
+} filter_sample;
+
+typedef struct{
+    filter_sample reg[FILTER_STAGES_MAX];
+    int stages;  // register length
+    int count;   // samples held, up to stages
+    int head;    // slot the next sample goes into
+    double t_fed; // time of the newest sample picked with consume, 0 before any
+} clock_filter;
+
+static inline void filter_init(clock_filter *f, int stages) {
+    memset(f, 0, sizeof(*f));
+    f->stages = stages < 1 ? 1 : stages > FILTER_STAGES_MAX ? FILTER_STAGES_MAX : stages;
+}
+
+/* filter_add - shift a sample in, pushing the oldest out once the register is full */
+static inline void filter_add(clock_filter *f, double t, double l, double u) {
+    f->reg[f->head].t = t;
+    f->reg[f->head].l = l;
+    f->reg[f->head].u = u;
+    f->head = (f->head + 1) % f->stages;
+    if (f->count < f->stages)
+        f->count++;
+}
+
+/*
+ * filter_pick - the keep narrowest samples as seen at local time t_now,
+ * given the drift skew (0 if unknown), written to out; returns how many.
+ * With consume set, only samples newer than any consumed before are
+ * candidates, and the ones picked are consumed.
+ */
+static inline int filter_pick(clock_filter *f, int keep, double t_now, double skew, int consume,
+                              ntp_survivor *out) {
+    double width[FILTER_STAGES_MAX];
+    int taken[FILTER_STAGES_MAX] = { 0 };
+    int i, k, best, avail = 0;
+    double t_fed = f->t_fed;
+
+    for (i = 0; i < f->count; i++) {
+        double age = t_now - f->reg[i].t;
+        width[i] = f->reg[i].u - f->reg[i].l + 2 * NTP_PHI * (age > 0 ? age : 0);
+        if (consume && f->reg[i].t <= t_fed)
+            taken[i] = 1;
+        else
+            avail++;
+    }
+    if (keep > avail)
+        keep = avail;
+    // keep is a handful, so picking by repeated minimum beats a sort
+    for (k = 0; k < keep; k++) {
+        best = -1;
+        for (i = 0; i < f->count; i++)
+            if (!taken[i] && (best < 0 || width[i] < width[best]))
+                best = i;
+        taken[best] = 1;
+        if (consume && f->reg[best].t > f->t_fed)
+            f->t_fed = f->reg[best].t;
+        double age = t_now - f->reg[best].t;
+        double shift = skew * age, grow = NTP_PHI * (age > 0 ? age : 0);
+        out[k].l = f->reg[best].l + shift - grow;
+        out[k].u = f->reg[best].u + shift + grow;
+        out[k].deviation = 0;
+    }
+    return keep;
+}
+
+/*
+ * ntp_select - selection and clustering over one round. candidates
+ * holds the m correctness intervals of the round and endpoints their 3m
+ * end and mid points; both scratch arrays are the size of what they
+ * shadow. Returns how many survivors are left at the front of survivors,
+ * with the selected interval in *l, *u, or -1 when no majority clique
+ * could be found.
+ */
+static inline int ntp_select(int m, int MIN, ntp_point *endpoints, ntp_point *endpoint_scratch,
+                             const ntp_survivor *candidates, ntp_survivor *survivors,
+                             ntp_survivor *survivor_scratch, double *l, double *u) {
+    int i, f, d, c, len;
+
+    /*
+     * Start of selection algorithm
+     */
+    sort_scratch(endpoints, 3*m, sizeof(ntp_point), endpoint_scratch, compare_select);
+
+    f = 0; // set the number of falsetickers to zero
+    while(1){
+        *l = *u = 0;
+        d = 0;
+        c = 0;
+        for(i = 0; i < 3*m; i++){
+            if(endpoints[i].type == 0)
+                c++;
+            else if(endpoints[i].type == 2)
+                c--;
+            else
+                d++;
+
+            if(c >= (m - f)){
+                *l = endpoints[i].value;
+                break;
+            }
+        }
+
+        c = 0;
+        for(i = 0; i < 3*m; i++){
+            if(endpoints[3*m - 1 - i].type == 2)
+                c++;
+            else if(endpoints[3*m - 1 - i].type == 0)
+                c--;
+            else
+                d++;
+
+            if(c >= (m - f)){
+                *u = endpoints[3*m - 1 - i].value;
+                break;
+            }
+        }
+
+        if(d <= f && *l < *u)
+            break;
+        f++;
+        if(f >= m/2)
+            return -1; // a majority clique could not be found
+    }
+
+    len = 0;
+    for(i = 0; i < m; i++){
+        if((candidates[i].l + candidates[i].u >= 2 * *l) && (candidates[i].l + candidates[i].u) <= 2 * *u){
+            survivors[len].l = candidates[i].l;
+            survivors[len].u = candidates[i].u;
+            len++;
+        }
+        survivors[i].deviation = 0;
+    }
+    /* End of selection algorithm */
+
+    /*
+     * Start of clustering algorithm
+     */
+    while(len > MIN){
+        for(i = 0; i < len; i++)
+            survivors[i].deviation = find_deviation(survivors, i, len);
+        sort_scratch(survivors, len, sizeof(ntp_survivor), survivor_scratch, compare_cluster);
+        len--;
+    }
+    /* End of clustering algorithm */
+    return len;
+}
+
+/*
+ * ntp_combine - ntp_select, then the survivors' offsets averaged with
+ * weights inversely proportional to their widths. Returns 0 with the
+ * combined offset in *estimate, or -1 when no majority clique could be
+ * found.
+ */
+static inline int ntp_combine(int m, int MIN, ntp_point *endpoints, ntp_point *endpoint_scratch,
+                              const ntp_survivor *candidates, ntp_survivor *survivors,
+                              ntp_survivor *survivor_scratch, double *estimate, double *l, double *u) {
+    int i, len;
+    double y, z;
+
+    len = ntp_select(m, MIN, endpoints, endpoint_scratch, candidates, survivors, survivor_scratch, l, u);
+    if (len < 0)
+        return -1;
+
+    /*
+     * Start of combining algorithm
+     */
+    y = 0;
+    z = 0;
+    for(i = 0; i < len; i++){
+        y += 2/(survivors[i].u - survivors[i].l);
+        z += (survivors[i].u + survivors[i].l)/(survivors[i].u - survivors[i].l);
+    }
+    *estimate = z/y;
+    /* End of combining algorithm */
+    return 0;
+}
+
+/*
+ * Drift (skew) fit: weighted least squares of offset against local time
+ * over the last window rounds, each weighted by 1/bound^2. The sums are
+ * updated in O(1) per round, adding the new round and taking out the one
+ * leaving the window. Times are kept relative to t_ref to hold on to
+ * precision in t^2; once they stray SKEW_REBASE seconds from it the sums
+ * are rebuilt around the newest round, which also clears any rounding
+ * the running subtraction has built up.
+ */
+#define SKEW_WINDOW_MAX 64
+#define SKEW_REBASE 86400.0
+#define SKEW_MIN_BOUND 1e-6 // floor on a round's bound, so one round cannot take all the weight
+
+typedef struct{
+    double t[SKEW_WINDOW_MAX], x[SKEW_WINDOW_MAX], w[SKEW_WINDOW_MAX];
+    int window, count, next;
+    double t_ref;
+    double sw, swt, swx, swtt, swtx;
+    double offset;   // fitted offset at t_last, s
+    double skew;     // fitted drift, s/s
+    double skew_err; // standard error of skew, s/s
+    double t_last;
+} skew_fit;
+
+static inline void skew_init(skew_fit *f, int window) {
+    memset(f, 0, sizeof(*f));
+    f->window = window < 2 ? 2 : window > SKEW_WINDOW_MAX ? SKEW_WINDOW_MAX : window;
+}
+
+static inline void skew_sums(skew_fit *f, int i, double sign) {
+    double t = f->t[i] - f->t_ref, w = sign * f->w[i];
+    f->sw += w;
+    f->swt += w * t;
+    f->swx += w * f->x[i];
+    f->swtt += w * t * t;
+    f->swtx += w * t * f->x[i];
+}
+
+/* skew_add - fold in a round's offset at local time t with error bound, then refit */
+static inline void skew_add(skew_fit *f, double t, double offset, double bound) {
+    int n = f->count < f->window ? f->count : f->window;
+    int i = f->next, k;
+    double b = bound > SKEW_MIN_BOUND ? bound : SKEW_MIN_BOUND;
+    double stt, stx;
+
+    if (f->count == 0)
+        f->t_ref = t;
+    if (n == f->window)
+        skew_sums(f, i, -1);
+    f->t[i] = t;
+    f->x[i] = offset;
+    f->w[i] = 1 / (b * b);
+    f->next = (i + 1) % f->window;
+    f->count++;
+    if (n < f->window)
+        n++;
+    if (fabs(t - f->t_ref) > SKEW_REBASE) {
+        f->t_ref = t;
+        f->sw = f->swt = f->swx = f->swtt = f->swtx = 0;
+        for (k = 0; k < n; k++)
+            skew_sums(f, k, 1);
+    } else {
+        skew_sums(f, i, 1);
+    }
+
+    f->t_last = t;
+    stt = f->swtt - f->swt * f->swt / f->sw;
+    stx = f->swtx - f->swt * f->swx / f->sw;
+    if (n < 2 || stt <= 0) {
+        f->skew = 0;
+        f->skew_err = 0;
+        f->offset = offset;
+        return;
+    }
+    f->skew = stx / stt;
+    f->skew_err = sqrt(1 / stt);
+    f->offset = f->swx / f->sw + f->skew * ((t - f->t_ref) - f->swt / f->sw);
+}
+
+/* skew_predict - the fitted offset at local time t */
+static inline double skew_predict(const skew_fit *f, double t) {
+    return f->offset + f->skew * (t - f->t_last);
+}
+
+/*
+ * Offset/skew Kalman filter, an alternative to combining: the state is
+ * the offset and its drift, and every survivor of a round is one
+ * measurement of the offset whose variance is its half-width squared.
+ * Between measurements the offset follows the drift; q_offset (s^2/s)
+ * lets the offset wander on its own and q_skew ((s/s)^2/s) lets the
+ * drift wander, e.g. as the crystals warm up.
+ */
+#define OKF_Q_OFFSET 1e-12
+#define OKF_Q_SKEW 1e-16
+#define OKF_SKEW_SD0 50e-6 // drift uncertainty before the first measurement, s/s
+#define OKF_MIN_SD 1e-7    // floor on a measurement's standard deviation, s
+
+typedef struct{
+    double offset, skew;  // s, s/s at local time t
+    double P[2][2];       // state covariance
+    double t;
+    double q_offset, q_skew;
+    int primed;
+} offset_kf;
+
+static inline void okf_init(offset_kf *k, double q_offset, double q_skew) {
+    memset(k, 0, sizeof(*k));
+    k->q_offset = q_offset;
+    k->q_skew = q_skew;
+}
+
+/* okf_predict - carry the state forward to local time t */
+static inline void okf_predict(offset_kf *k, double t) {
+    double dt = t - k->t;
+    double p00 = k->P[0][0], p01 = k->P[0][1], p11 = k->P[1][1];
+
+    if (dt <= 0)
+        return;
+    k->offset += k->skew * dt;
+    k->P[0][0] = p00 + 2*dt*p01 + dt*dt*p11 + k->q_offset*dt + k->q_skew*dt*dt*dt/3;
+    k->P[0][1] = k->P[1][0] = p01 + dt*p11 + k->q_skew*dt*dt/2;
+    k->P[1][1] = p11 + k->q_skew*dt;
+    k->t = t;
+}
+
+/* okf_update - fold in one offset measurement z of variance r taken at local time t */
+static inline void okf_update(offset_kf *k, double t, double z, double r) {
+    double s, k0, k1, y, p00, p01, p11;
+
+    if (!k->primed) {
+        k->offset = z;
+        k->skew = 0;
+        k->P[0][0] = r;
+        k->P[0][1] = k->P[1][0] = 0;
+        k->P[1][1] = OKF_SKEW_SD0 * OKF_SKEW_SD0;
+        k->t = t;
+        k->primed = 1;
+        return;
+    }
+    okf_predict(k, t);
+    p00 = k->P[0][0];
+    p01 = k->P[0][1];
+    p11 = k->P[1][1];
+    s = p00 + r;
+    k0 = p00 / s;
+    k1 = p01 / s;
+    y = z - k->offset;
+    k->offset += k0 * y;
+    k->skew += k1 * y;
+    k->P[0][0] = (1 - k0) * p00;
+    k->P[0][1] = k->P[1][0] = (1 - k0) * p01;
+    k->P[1][1] = p11 - k1 * p01;
+}
+
+/* okf_round - feed a round's survivors in; each lands at t_round */
+static inline void okf_round(offset_kf *k, double t_round, const ntp_survivor *survivors, int len) {
+    int i;
+
+    for (i = 0; i < len; i++) {
+        double half = fmax((survivors[i].u - survivors[i].l) / 2, OKF_MIN_SD);
+        okf_update(k, t_round, (survivors[i].u + survivors[i].l) / 2, half * half);
+    }
+}
+
+/* ask the kernel to stamp received datagrams; -1 if it will not */
+static inline int enable_rx_timestamps(int sockfd) {
+    int optval = 1;
+#ifdef SO_TIMESTAMPNS
+    return setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &optval, sizeof(optval));
+#else
+    return setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMP, &optval, sizeof(optval));
+#endif
+}
+
+/*
+ * recv_stamped - recvfrom that also hands back the kernel receive
+ * time-stamp, if one was attached. Returns the byte count; *stamped is
+ * 0 when no stamp came with the datagram.
+ */
+static inline int recv_stamped(int sockfd, void *buf, size_t len, struct sockaddr_in *addr, socklen_t *addrlen,
+                               struct timeval *stamp, int *stamped) {
+    char control[128];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int n;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = *addrlen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    *stamped = 0;
+    n = recvmsg(sockfd, &msg, 0);
+    if (n < 0)
+        return n;
+    *addrlen = msg.msg_namelen;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET)
+            continue;
+#ifdef SO_TIMESTAMPNS
+        if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec *ts = (struct timespec *)CMSG_DATA(cmsg);
+            stamp->tv_sec = ts->tv_sec;
+            stamp->tv_usec = ts->tv_nsec / 1000;
+            *stamped = 1;
+        }
+#else
+        if (cmsg->cmsg_type == SCM_TIMESTAMP) {
+            memcpy(stamp, CMSG_DATA(cmsg), sizeof(struct timeval));
+            *stamped = 1;
+        }
+#endif
+    }
+    return n;
+}
+
+#endif
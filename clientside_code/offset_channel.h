@@ -0,0 +1,528 @@
+/*
+ * offset_channel.h - hand the latest clock offset from the sync side to
+ * its consumers
+ *
+ * The channel is result.txt, mapped shared. Its first eight bytes are
+ * still the offset as a double, so anything reading map[0] keeps
+ * working. Behind it sits a generation word that doubles as a seqlock:
+ * it is odd while a publish is in progress and grows by two with each
+ * one, so a reader gets a consistent offset and can tell a fresh value
+ * from one it has already used.
+ *
+ * A consumer that wants to sleep until the next publish picks one of
+ *   OC_WAIT_FUTEX    futex on the generation word in the shared page
+ *   OC_WAIT_EVENTFD  an eventfd the writer hands over through <path>.sock
+ *                    on its first publish after the consumer connects
+ *   OC_WAIT_INOTIFY  inotify on the file, whose times the writer touches
+ *   OC_WAIT_POLL     look once a millisecond
+ * The writer does all four on every publish, so each consumer chooses
+ * for itself. An eventfd consumer whose writer is not running, or has
+ * gone, sleeps on the futex instead and connects again to whichever
+ * writer is running next.
+ *
+ * The page also keeps the last OC_HISTORY publishes as (local time,
+ * offset, error bound) points, each slot under its own sequence word so
+ * the writer never waits on a reader. oc_offset_at() interpolates
+ * between them, or extrapolates past the newest along the latest drift,
+ * to get the offset at a given instant rather than the latest one. A
+ * writer that fits the drift across rounds publishes it with each point,
+ * and extrapolation then follows the fit rather than the last two points.
+ */
+#ifndef OFFSET_CHANNEL_H
+#define OFFSET_CHANNEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <linux/futex.h>
+#include "ntp.h"
+
+#define OC_MAGIC 0x4f464332 // "OFC2"
+#define OC_MAX_WAITERS 16   // eventfd consumers the writer keeps track of
+#define OC_HISTORY 64       // publishes kept for interpolation
+#define OC_RECONNECT_MS 1000 // how often an eventfd consumer without a writer tries to reach one
+
+enum{ OC_WAIT_POLL, OC_WAIT_FUTEX, OC_WAIT_EVENTFD, OC_WAIT_INOTIFY };
+
+static const char *oc_wait_names[] = { "poll", "futex", "eventfd", "inotify" };
+
+/* One published offset */
+typedef struct{
+    _Atomic uint32_t seq;       // odd while the slot is being written
+    uint32_t index;             // which publish the slot holds
+    double t_local;             // local clock time the offset applies to, s
+    double offset;              // s
+    double bound;               // half-width of the offset's error interval, s
+    double skew;                // drift of the offset, s/s, when the writer fits one
+    double skew_err;            // its standard error, 0 when there is no fit
+} oc_point;
+
+/* Layout of the shared page */
+typedef struct{
+    double offset;              // latest offset, s; first so readers of map[0] still see it
+    _Atomic uint32_t gen;       // 2 x publishes, odd during one; the futex word
+    uint32_t magic;             // OC_MAGIC once a writer has set the file up
+    _Atomic uint64_t t_publish; // CLOCK_REALTIME ns of the latest publish
+    _Atomic uint32_t head;      // points written so far
+    uint32_t pad;
+    oc_point history[OC_HISTORY];
+} oc_page;
+
+typedef struct{
+    int fd;
+    oc_page *page;
+    int listen_fd;                 // <path>.sock, where eventfd consumers connect
+    int conns[OC_MAX_WAITERS];     // one per eventfd consumer, to notice it leave
+    int efds[OC_MAX_WAITERS];
+    int nwaiters;
+} oc_writer;
+
+typedef struct{
+    int fd;
+    oc_page *page;
+    int mode;
+    int wait_fd;     // inotify, or the socket the eventfd arrives on, -1 while not connected
+    int efd;         // eventfd, -1 until the writer has sent it
+    char sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+} oc_reader;
+
+static inline void oc_sock_path(char *dst, size_t len, const char *path) {
+    snprintf(dst, len, "%s.sock", path);
+}
+
+/* oc_map - open path and map the channel page, growing an old 9-byte result.txt */
+static inline oc_page *oc_map(const char *path, int *fdp) {
+    struct stat st;
+    oc_page *page;
+    int fd = open(path, O_RDWR | O_CREAT, (mode_t)0600);
+
+    if (fd == -1)
+        return NULL;
+    if (fstat(fd, &st) == -1 || ((size_t)st.st_size < sizeof(oc_page) && ftruncate(fd, sizeof(oc_page)) == -1)) {
+        close(fd);
+        return NULL;
+    }
+    page = mmap(0, sizeof(oc_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (page == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    *fdp = fd;
+    return page;
+}
+
+/* oc_writer_open - set the channel up for publishing; -1 with errno set on failure */
+static inline int oc_writer_open(oc_writer *w, const char *path) {
+    struct sockaddr_un addr;
+
+    memset(w, 0, sizeof(*w));
+    w->page = oc_map(path, &w->fd);
+    if (w->page == NULL)
+        return -1;
+    // a restarted writer carries on from the old generation, so no reader mistakes it for news
+    if (w->page->magic != OC_MAGIC) {
+        atomic_store(&w->page->gen, 0);
+        atomic_store(&w->page->head, 0);
+        w->page->magic = OC_MAGIC;
+    } else if (atomic_load(&w->page->gen) & 1) {
+        atomic_fetch_add(&w->page->gen, 1);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    oc_sock_path(addr.sun_path, sizeof(addr.sun_path), path);
+    unlink(addr.sun_path);
+    w->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (w->listen_fd == -1 || bind(w->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(w->listen_fd, OC_MAX_WAITERS) == -1) {
+        perror("offset channel: no eventfd consumers");
+        if (w->listen_fd != -1)
+            close(w->listen_fd);
+        w->listen_fd = -1;
+    }
+    return 0;
+}
+
+/* oc_hand_eventfd - give a newly connected consumer its eventfd */
+static inline void oc_hand_eventfd(oc_writer *w, int conn) {
+    char ctrl[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char byte = 0;
+    int efd;
+
+    if (w->nwaiters == OC_MAX_WAITERS || (efd = eventfd(0, EFD_CLOEXEC)) == -1) {
+        close(conn);
+        return;
+    }
+    memset(&msg, 0, sizeof(msg));
+    memset(ctrl, 0, sizeof(ctrl));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &efd, sizeof(int));
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != 1) {
+        close(efd);
+        close(conn);
+        return;
+    }
+    w->conns[w->nwaiters] = conn;
+    w->efds[w->nwaiters++] = efd;
+}
+
+/* oc_notify_eventfds - drop consumers that went away, take on new ones, bump the rest */
+static inline void oc_notify_eventfds(oc_writer *w) {
+    uint64_t one = 1;
+    int i, conn;
+
+    for (i = 0; i < w->nwaiters; ) {
+        struct pollfd pfd = { w->conns[i], POLLIN, 0 };
+        // a consumer never writes, so readable means it closed
+        if (poll(&pfd, 1, 0) > 0) {
+            close(w->conns[i]);
+            close(w->efds[i]);
+            w->nwaiters--;
+            w->conns[i] = w->conns[w->nwaiters];
+            w->efds[i] = w->efds[w->nwaiters];
+            continue;
+        }
+        i++;
+    }
+    if (w->listen_fd != -1)
+        while ((conn = accept(w->listen_fd, NULL, NULL)) != -1)
+            oc_hand_eventfd(w, conn);
+    for (i = 0; i < w->nwaiters; i++)
+        if (write(w->efds[i], &one, sizeof(one)) != sizeof(one))
+            perror("offset channel: eventfd");
+}
+
+/*
+ * oc_publish - store a new offset, valid at local time t_local to within
+ * bound and drifting at skew (skew_err 0 when not fitted), append it to
+ * the history and wake every kind of waiter
+ */
+static inline void oc_publish(oc_writer *w, double t_local, double offset, double bound,
+                              double skew, double skew_err) {
+    struct timespec ts;
+    uint32_t gen = atomic_load_explicit(&w->page->gen, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&w->page->head, memory_order_relaxed);
+    oc_point *pt = &w->page->history[head % OC_HISTORY];
+    uint32_t seq = atomic_load_explicit(&pt->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&pt->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    pt->index = head;
+    pt->t_local = t_local;
+    pt->offset = offset;
+    pt->bound = bound;
+    pt->skew = skew;
+    pt->skew_err = skew_err;
+    atomic_store_explicit(&pt->seq, seq + 2, memory_order_release);
+    atomic_store_explicit(&w->page->head, head + 1, memory_order_release);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    atomic_store_explicit(&w->page->gen, gen + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    w->page->offset = offset;
+    atomic_store_explicit(&w->page->t_publish, (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec,
+                          memory_order_relaxed);
+    atomic_store_explicit(&w->page->gen, gen + 2, memory_order_release);
+
+    syscall(SYS_futex, &w->page->gen, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    oc_notify_eventfds(w);
+    // stores through the mapping raise no inotify event, a time change does
+    futimens(w->fd, NULL);
+}
+
+/*
+ * oc_connect - reach the writer's socket so it hands over an eventfd on
+ * its next publish; -1 if no writer is listening
+ */
+static inline int oc_connect(oc_reader *r) {
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, r->sock_path, sizeof(addr.sun_path));
+    r->wait_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (r->wait_fd != -1 && connect(r->wait_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        return 0;
+    if (r->wait_fd != -1)
+        close(r->wait_fd);
+    r->wait_fd = -1;
+    return -1;
+}
+
+/* oc_disconnect - let go of a writer that has gone, and of its eventfd */
+static inline void oc_disconnect(oc_reader *r) {
+    if (r->efd != -1)
+        close(r->efd);
+    if (r->wait_fd != -1)
+        close(r->wait_fd);
+    r->efd = -1;
+    r->wait_fd = -1;
+}
+
+/* oc_reader_open - map the channel for reading with the given wait mode; -1 on failure */
+static inline int oc_reader_open(oc_reader *r, const char *path, int mode) {
+    memset(r, 0, sizeof(*r));
+    r->mode = mode;
+    r->wait_fd = -1;
+    r->efd = -1;
+    r->page = oc_map(path, &r->fd);
+    if (r->page == NULL)
+        return -1;
+    if (mode == OC_WAIT_INOTIFY) {
+        r->wait_fd = inotify_init1(IN_CLOEXEC);
+        if (r->wait_fd == -1 || inotify_add_watch(r->wait_fd, path, IN_ATTRIB | IN_MODIFY) == -1)
+            return -1;
+    } else if (mode == OC_WAIT_EVENTFD) {
+        // a writer that is not up yet is tried again from oc_wait
+        oc_sock_path(r->sock_path, sizeof(r->sock_path), path);
+        oc_connect(r);
+    }
+    return 0;
+}
+
+/*
+ * oc_read - copy out the latest offset; returns its generation, the
+ * number of publishes so far, which is 0 while nothing has been published
+ */
+static inline uint32_t oc_read(oc_reader *r, double *offset, uint64_t *t_publish) {
+    uint32_t g1, g2;
+    double value;
+    uint64_t t;
+
+    for (;;) {
+        g1 = atomic_load_explicit(&r->page->gen, memory_order_acquire);
+        if (g1 & 1)
+            continue;
+        value = r->page->offset;
+        t = atomic_load_explicit(&r->page->t_publish, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        g2 = atomic_load_explicit(&r->page->gen, memory_order_relaxed);
+        if (g1 == g2)
+            break;
+    }
+    if (offset != NULL)
+        *offset = value;
+    if (t_publish != NULL)
+        *t_publish = t;
+    return g1 / 2;
+}
+
+/* oc_take_eventfd - swap the socket for the eventfd the writer sent over it */
+static inline int oc_take_eventfd(oc_reader *r) {
+    char ctrl[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char byte;
+    int efd;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    if (recvmsg(r->wait_fd, &msg, 0) != 1 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+        cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+    memcpy(&efd, CMSG_DATA(cmsg), sizeof(int));
+    // the socket stays open: its closing is how the writer learns we left
+    r->efd = efd;
+    return 0;
+}
+
+/*
+ * oc_wait - sleep until the generation moves past *gen or timeout_ms runs
+ * out (-1 waits for ever); 1 with *gen moved on, 0 on timeout, -1 if the
+ * wait itself failed
+ */
+static inline int oc_wait(oc_reader *r, uint32_t *gen, int timeout_ms) {
+    struct timespec deadline, now, left;
+    uint32_t cur;
+    uint64_t v;
+    char buf[4096];
+    int ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while ((cur = oc_read(r, NULL, NULL)) == *gen) {
+        ms = -1;
+        if (timeout_ms >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left.tv_sec = deadline.tv_sec - now.tv_sec;
+            left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (left.tv_nsec < 0) {
+                left.tv_sec--;
+                left.tv_nsec += 1000000000L;
+            }
+            if (left.tv_sec < 0)
+                return 0;
+            ms = (int)(left.tv_sec * 1000 + left.tv_nsec / 1000000) + 1;
+        }
+        switch (r->mode) {
+        case OC_WAIT_EVENTFD:
+            if (r->wait_fd != -1 || oc_connect(r) == 0) {
+                struct pollfd pfd[2] = { { r->wait_fd, POLLIN, 0 }, { r->efd, POLLIN, 0 } };
+                if (poll(pfd, r->efd != -1 ? 2 : 1, ms) < 0) {
+                    if (errno != EINTR)
+                        return -1;
+                    break;
+                }
+                if ((pfd[1].revents & POLLIN) && read(r->efd, &v, sizeof(v)) != sizeof(v))
+                    return -1;
+                /*
+                 * The writer sends nothing after the eventfd, so anything
+                 * more on the socket is it hanging up, having exited or
+                 * been restarted; the next pass reaches its successor.
+                 */
+                if (pfd[0].revents && (r->efd != -1 || oc_take_eventfd(r) < 0))
+                    oc_disconnect(r);
+                break;
+            }
+            // no writer to hand an eventfd over; a restarted one's first publish wakes the futex
+            if (ms < 0 || ms > OC_RECONNECT_MS) {
+                left.tv_sec = OC_RECONNECT_MS / 1000;
+                left.tv_nsec = (long)(OC_RECONNECT_MS % 1000) * 1000000;
+            }
+            syscall(SYS_futex, &r->page->gen, FUTEX_WAIT, *gen * 2, &left, NULL, 0);
+            break;
+        case OC_WAIT_FUTEX:
+            // sleeps only if the word still holds the generation we have seen
+            syscall(SYS_futex, &r->page->gen, FUTEX_WAIT, *gen * 2, timeout_ms >= 0 ? &left : NULL, NULL, 0);
+            break;
+        case OC_WAIT_INOTIFY: {
+            struct pollfd pfd = { r->wait_fd, POLLIN, 0 };
+            int n = poll(&pfd, 1, ms);
+            if ((n < 0 && errno != EINTR) || (n > 0 && read(r->wait_fd, buf, sizeof(buf)) < 0))
+                return -1;
+            break;
+        }
+        default:
+            usleep(1000);
+        }
+    }
+    *gen = cur;
+    return 1;
+}
+
+/* oc_point_read - copy out history entry index; -1 if it is being written or was overwritten */
+static inline int oc_point_read(oc_reader *r, uint32_t index, oc_point *out) {
+    oc_point *pt = &r->page->history[index % OC_HISTORY];
+    uint32_t s1, s2;
+
+    s1 = atomic_load_explicit(&pt->seq, memory_order_acquire);
+    if (s1 & 1)
+        return -1;
+    out->index = pt->index;
+    out->t_local = pt->t_local;
+    out->offset = pt->offset;
+    out->bound = pt->bound;
+    out->skew = pt->skew;
+    out->skew_err = pt->skew_err;
+    atomic_thread_fence(memory_order_acquire);
+    s2 = atomic_load_explicit(&pt->seq, memory_order_relaxed);
+    return s1 == s2 && out->index == index ? 0 : -1;
+}
+
+/*
+ * oc_offset_at - the offset at local time t and its error bound, from the
+ * history: interpolated between the publishes either side of t, held at
+ * the oldest before it, or carried past the newest. Past the newest it
+ * follows the published skew with the bound growing by its error, or
+ * without one the drift of the last two points (at most NTP_PHI) with the
+ * bound growing at NTP_PHI. Returns the number of points used, 0 if there
+ * is no history yet.
+ */
+static inline int oc_offset_at(oc_reader *r, double t, double *offset, double *bound) {
+    uint32_t head = atomic_load_explicit(&r->page->head, memory_order_acquire);
+    uint32_t oldest = head > OC_HISTORY ? head - OC_HISTORY : 0;
+    oc_point newer, older;
+    uint32_t i;
+
+    if (head == 0)
+        return 0;
+    memset(&newer, 0, sizeof(newer));
+    // the newest point may lose a race with the next publish; step back until one reads clean
+    for (i = head; i > oldest; i--)
+        if (oc_point_read(r, i - 1, &newer) == 0)
+            break;
+    if (i == oldest)
+        return 0;
+    i--;
+    if (t >= newer.t_local && newer.skew_err > 0) {
+        double growth = newer.skew_err < NTP_PHI ? newer.skew_err : NTP_PHI;
+        *offset = newer.offset + newer.skew * (t - newer.t_local);
+        *bound = newer.bound + growth * (t - newer.t_local);
+        return 1;
+    }
+    if (t >= newer.t_local) {
+        double drift = 0;
+        if (i > oldest && oc_point_read(r, i - 1, &older) == 0 && newer.t_local > older.t_local)
+            drift = (newer.offset - older.offset) / (newer.t_local - older.t_local);
+        drift = drift > NTP_PHI ? NTP_PHI : drift < -NTP_PHI ? -NTP_PHI : drift;
+        *offset = newer.offset + drift * (t - newer.t_local);
+        *bound = newer.bound + NTP_PHI * (t - newer.t_local);
+        return drift != 0 ? 2 : 1;
+    }
+    // walk back to the pair that brackets t
+    while (i > oldest && oc_point_read(r, i - 1, &older) == 0) {
+        if (older.t_local <= t) {
+            double w = newer.t_local > older.t_local ? (t - older.t_local) / (newer.t_local - older.t_local) : 1;
+            *offset = older.offset + w * (newer.offset - older.offset);
+            *bound = older.bound + w * (newer.bound - older.bound);
+            return 2;
+        }
+        newer = older;
+        i--;
+    }
+    // t is older than anything kept
+    *offset = newer.offset;
+    *bound = newer.bound;
+    return 1;
+}
+
+/* oc_wait_mode - parse a wait mode name; -1 if unknown */
+static inline int oc_wait_mode(const char *name) {
+    int i;
+
+    for (i = 0; i < 4; i++)
+        if (strcmp(name, oc_wait_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+#endif
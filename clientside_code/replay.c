@@ -0,0 +1,267 @@
+/*
+ * replay.c - replay a recorded latency trace through estimator configurations
+ * usage: replay [-j threads] <trace> <spec>...
+ *   -j  worker threads (default: online cores)
+ *
+ * The trace is any file whose lines start with a latency sample, such as
+ * the latency.txt written by tcpclient. A spec is an estimator spec from
+ * estimator.h in which any parameter may also be a range:
+ *   lo..hi/step    lo, lo+step, ... hi
+ *   lo..hi*factor  lo, lo*factor, ... hi
+ * e.g. "jk:0.05..0.5/0.05:0.1..0.5/0.1:2..6/1" or "kalman:1e-8..1e-4*10".
+ * Every combination is replayed over the whole trace, spread across the
+ * worker threads, and reported with its prediction error and y_up coverage.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "estimator.h"
+
+#define GRID_VALUES 64 // values per parameter range
+
+typedef struct{
+    char spec[64];
+    double mae, rmse, coverage;
+} replay_result;
+
+static double *samples;
+static size_t nsamples;
+static replay_result *results;
+static size_t nresults, cap_results;
+static _Atomic size_t next_config;
+
+/*
+ * error - wrapper for perror
+ */
+void error(char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+/* load_trace - map the trace and pull the first number off every line */
+static void load_trace(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat fileInfo = {0};
+    const char *map, *p, *end;
+    size_t cap;
+
+    if (fd == -1)
+        error("Error opening the trace");
+    if (fstat(fd, &fileInfo) == -1)
+        error("Error getting the trace size");
+    if (fileInfo.st_size == 0) {
+        fprintf(stderr, "Error: trace is empty, nothing to do\n");
+        exit(1);
+    }
+    map = mmap(0, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        error("Error mmapping the trace");
+    madvise((void *)map, fileInfo.st_size, MADV_SEQUENTIAL);
+
+    // A sample needs at least two bytes ("0\n"), which bounds the count
+    cap = fileInfo.st_size / 2 + 1;
+    samples = malloc(cap * sizeof(double));
+    if (samples == NULL)
+        error("Error allocating samples");
+    end = map + fileInfo.st_size;
+    for (p = map; p < end; ) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *eol = nl ? nl : end;
+        // strtod could run past an unterminated last line, so copy short tails
+        char line[64];
+        size_t len = eol - p < (long)sizeof(line) - 1 ? (size_t)(eol - p) : sizeof(line) - 1;
+        char *stop;
+        memcpy(line, p, len);
+        line[len] = '\0';
+        double v = strtod(line, &stop);
+        if (stop != line)
+            samples[nsamples++] = v;
+        p = eol + 1;
+    }
+    munmap((void *)map, fileInfo.st_size);
+    close(fd);
+}
+
+static void add_result(const char *spec) {
+    if (nresults == cap_results) {
+        cap_results = cap_results ? 2*cap_results : 64;
+        results = realloc(results, cap_results * sizeof(replay_result));
+        if (results == NULL)
+            error("Error allocating results");
+    }
+    snprintf(results[nresults++].spec, sizeof(results[0].spec), "%s", spec);
+}
+
+/* parse_field - expand one parameter into its list of values; count or -1 */
+static int parse_field(const char *field, double *values) {
+    const char *dots = strstr(field, "..");
+    char lo_text[32], *end;
+    double lo, hi, step, v;
+    char op;
+    int n = 0;
+
+    if (dots == NULL) {
+        values[0] = strtod(field, &end);
+        return end != field && *end == '\0' ? 1 : -1;
+    }
+    // "2..6" would otherwise parse as "2." followed by ".6"
+    if (dots == field || dots - field >= (long)sizeof(lo_text))
+        return -1;
+    memcpy(lo_text, field, dots - field);
+    lo_text[dots - field] = '\0';
+    lo = strtod(lo_text, &end);
+    if (*end != '\0')
+        return -1;
+    hi = strtod(dots + 2, &end);
+    op = *end;
+    if (op != '/' && op != '*')
+        return -1;
+    step = strtod(end + 1, &end);
+    if (*end != '\0')
+        return -1;
+    if (op == '/') {
+        if (step <= 0)
+            return -1;
+        // half a step of slack so rounding does not drop hi
+        for (n = 0; n < GRID_VALUES && lo + n*step <= hi + step/2; n++)
+            values[n] = lo + n*step;
+    } else {
+        if (step <= 1 || lo <= 0)
+            return -1;
+        for (v = lo; n < GRID_VALUES && v <= hi * (1 + 1e-9); v *= step)
+            values[n++] = v;
+    }
+    return n;
+}
+
+/* expand_grid - add every configuration named by a possibly ranged spec */
+static void expand_grid(const char *grid) {
+    double values[3][GRID_VALUES];
+    int counts[3] = { 1, 1, 1 }, i, j, k;
+    char copy[256], *fields[4], *tok, *save;
+    int nfields = 0;
+    estimator probe;
+
+    snprintf(copy, sizeof(copy), "%s", grid);
+    for (tok = strtok_r(copy, ":", &save); tok != NULL; tok = strtok_r(NULL, ":", &save)) {
+        if (nfields == 4) {
+            fprintf(stderr, "bad spec %s\n", grid);
+            exit(1);
+        }
+        fields[nfields++] = tok;
+    }
+    if (nfields == 0) {
+        fprintf(stderr, "bad spec %s\n", grid);
+        exit(1);
+    }
+    for (i = 0; i < nfields - 1; i++) {
+        counts[i] = parse_field(fields[i + 1], values[i]);
+        if (counts[i] < 1) {
+            fprintf(stderr, "bad parameter %s in %s\n", fields[i + 1], grid);
+            exit(1);
+        }
+    }
+    for (i = 0; i < counts[0]; i++)
+        for (j = 0; j < counts[1]; j++)
+            for (k = 0; k < counts[2]; k++) {
+                char spec[128];
+                int len = snprintf(spec, sizeof(spec), "%s", fields[0]);
+                if (nfields > 1)
+                    len += snprintf(spec + len, sizeof(spec) - len, ":%g", values[0][i]);
+                if (nfields > 2)
+                    len += snprintf(spec + len, sizeof(spec) - len, ":%g", values[1][j]);
+                if (nfields > 3)
+                    snprintf(spec + len, sizeof(spec) - len, ":%g", values[2][k]);
+                if (est_init(&probe, spec) < 0) {
+                    fprintf(stderr, "bad spec %s\n", spec);
+                    exit(1);
+                }
+                add_result(probe.spec);
+            }
+}
+
+/* worker - claim configurations one at a time and stream the trace through each */
+static void *worker(void *arg) {
+    estimator *e = malloc(sizeof(estimator));
+    size_t c, i;
+
+    (void)arg;
+
+    if (e == NULL)
+        error("Error allocating estimator");
+    while ((c = atomic_fetch_add(&next_config, 1)) < nresults) {
+        est_init(e, results[c].spec);
+        for (i = 0; i < nsamples; i++)
+            est_sample(e, samples[i]);
+        results[c].mae = e->n ? e->sum_abs / e->n : 0;
+        results[c].rmse = e->n ? sqrt(e->sum_sq / e->n) : 0;
+        results[c].coverage = e->n ? 100.0 * e->covered / e->n : 0;
+    }
+    free(e);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct timespec t0, t1;
+    pthread_t *threads;
+    size_t c, best = 0;
+    double secs;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        switch (opt) {
+        case 'j':
+            nthreads = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-j threads] <trace> <spec>...\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind < 2 || nthreads < 1) {
+        fprintf(stderr, "usage: %s [-j threads] <trace> <spec>...\n", argv[0]);
+        exit(1);
+    }
+
+    load_trace(argv[optind]);
+    for (i = optind + 1; i < argc; i++)
+        expand_grid(argv[i]);
+    if (nsamples < 2) {
+        fprintf(stderr, "Error: trace holds %zu samples, need at least 2\n", nsamples);
+        exit(1);
+    }
+    if ((size_t)nthreads > nresults)
+        nthreads = nresults;
+
+    threads = calloc(nthreads, sizeof(pthread_t));
+    if (threads == NULL)
+        error("Error allocating threads");
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < nthreads; i++)
+        if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+            error("Error creating worker thread");
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    printf("%-28s %12s %12s %9s\n", "config", "mae", "rmse", "coverage");
+    for (c = 0; c < nresults; c++) {
+        printf("%-28s %12.6f %12.6f %8.1f%%\n", results[c].spec,
+               results[c].mae, results[c].rmse, results[c].coverage);
+        if (results[c].mae < results[best].mae)
+            best = c;
+    }
+    printf("best mae: %s\n", results[best].spec);
+    printf("replayed %zu samples x %zu configs on %ld threads in %.3f s (%.1f M samples/s)\n",
+           nsamples, nresults, nthreads, secs, nsamples * (double)nresults / secs / 1e6);
+    return 0;
+}
@@ -0,0 +1,394 @@
+/*
+ * sync_replay.c - compare offset pipelines on a recorded round trace
+ * usage: sync_replay [-n MIN] [-D rounds] [-q q_offset:q_skew]... [-f keep[:stages]]... <trace>
+ *        sync_replay -g rounds [-m m] [-s ppm] [-P secs] [-j us] > trace
+ *   -n  survivors kept by clustering (default 3)
+ *   -D  window of the drift fit run over the combined offsets (default 8)
+ *   -q  Kalman filter process noise, may be repeated (default 1e-12:1e-16)
+ *   -f  also run combine, and the first Kalman filter, behind a clock
+ *       filter that passes the keep narrowest of the last stages samples
+ *       (default 8), may be repeated
+ *   -g  instead write a synthetic trace of this many rounds of -m samples
+ *       (default 8), -P seconds apart (default 32), from a clock drifting
+ *       at -s ppm (default 20) behind a path whose queueing delays average
+ *       -j microseconds each way (default 2000)
+ *
+ * A trace line is one round as written by udpclient -R: the local time,
+ * m, the m sample intervals, and for synthetic traces the true offset at
+ * the end. Every round is run through
+ *   combine   selection, clustering and combining, what udpclient does
+ *   drift     combine, then the weighted least-squares drift fit (-D)
+ *   kalman    selection and clustering, then the offset/skew filter (-F)
+ *   filter    the clock filter, then combine on what it passes (-f)
+ *   filter+kalman  the clock filter, passing each sample on once, then
+ *             selection, clustering and the offset/skew filter (-f -F),
+ *             one per distinct keep. A trace stamps a round's samples
+ *             with the one round time, so once a round is consumed none
+ *             of it comes back and the pick is always the keep narrowest
+ *             of this round; stages would change nothing and is left out.
+ * Each pipeline predicts the round's offset from the rounds before it,
+ * the way a consumer extrapolates between publishes, then takes the round
+ * in. Predictions are scored against the true offset when the trace has
+ * it and against this round's combine otherwise; estimates after taking
+ * the round in are scored against the truth only.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include "ntp.h"
+
+#define MAX_PIPES 16
+
+enum{ PIPE_COMBINE, PIPE_DRIFT, PIPE_KALMAN, PIPE_FILTER, PIPE_FILTER_KALMAN };
+
+typedef struct{
+    int kind;
+    char name[48];
+    double estimate;   // combine: last offset
+    int have;          // 0 until the first round is in
+    skew_fit fit;
+    offset_kf kf;
+    clock_filter filter;
+    int keep;
+    // scores
+    unsigned long n_pred, n_est;
+    double pred_abs, pred_sq, est_abs, est_sq;
+    double ns;         // time spent taking rounds in
+} pipeline;
+
+static pipeline pipes[MAX_PIPES];
+static int npipes;
+
+/*
+ * error - wrapper for perror
+ */
+void error(char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+static double mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double predict(const pipeline *p, double t) {
+    switch (p->kind) {
+    case PIPE_DRIFT:
+        return skew_predict(&p->fit, t);
+    case PIPE_KALMAN:
+    case PIPE_FILTER_KALMAN:
+        return p->kf.offset + p->kf.skew * (t - p->kf.t);
+    default:
+        return p->estimate;
+    }
+}
+
+/* take_round - run one round through p; -1 if selection found no majority */
+static int take_round(pipeline *p, double t, int m, int MIN, ntp_point *endpoints, ntp_point *endpoint_scratch,
+                      const ntp_survivor *candidates, ntp_survivor *survivors, ntp_survivor *survivor_scratch) {
+    ntp_survivor picked[FILTER_STAGES_MAX];
+    double estimate, l, u;
+    int len, i;
+
+    if (p->kind == PIPE_FILTER_KALMAN) {
+        for (i = 0; i < m; i++)
+            filter_add(&p->filter, t, candidates[i].l, candidates[i].u);
+        len = filter_pick(&p->filter, p->keep, t, p->kf.skew, 1, picked);
+        if (len < MIN)
+            return -1;
+        ntp_endpoints(endpoints, picked, len);
+        len = ntp_select(len, MIN, endpoints, endpoint_scratch, picked, survivors, survivor_scratch, &l, &u);
+        if (len < 0)
+            return -1;
+        okf_round(&p->kf, t, survivors, len);
+        return 0;
+    }
+    if (p->kind == PIPE_FILTER) {
+        for (i = 0; i < m; i++)
+            filter_add(&p->filter, t, candidates[i].l, candidates[i].u);
+        len = filter_pick(&p->filter, p->keep, t, 0, 0, picked);
+        if (len < MIN)
+            return -1;
+        ntp_endpoints(endpoints, picked, len);
+        if (ntp_combine(len, MIN, endpoints, endpoint_scratch, picked, survivors, survivor_scratch,
+                        &estimate, &l, &u) < 0)
+            return -1;
+        p->estimate = estimate;
+        return 0;
+    }
+    ntp_endpoints(endpoints, candidates, m);
+    if (p->kind == PIPE_KALMAN) {
+        len = ntp_select(m, MIN, endpoints, endpoint_scratch, candidates, survivors, survivor_scratch, &l, &u);
+        if (len < 0)
+            return -1;
+        okf_round(&p->kf, t, survivors, len);
+        return 0;
+    }
+    if (ntp_combine(m, MIN, endpoints, endpoint_scratch, candidates, survivors, survivor_scratch,
+                    &estimate, &l, &u) < 0)
+        return -1;
+    if (p->kind == PIPE_DRIFT) {
+        skew_add(&p->fit, t, estimate, (u - l) / 2);
+        return 0;
+    }
+    p->estimate = estimate;
+    return 0;
+}
+
+static double current(const pipeline *p) {
+    if (p->kind == PIPE_KALMAN || p->kind == PIPE_FILTER_KALMAN)
+        return p->kf.offset;
+    return p->kind == PIPE_DRIFT ? p->fit.offset : p->estimate;
+}
+
+static void add_pipe(int kind, const char *name) {
+    if (npipes == MAX_PIPES) {
+        fprintf(stderr, "at most %d pipelines\n", MAX_PIPES);
+        exit(1);
+    }
+    memset(&pipes[npipes], 0, sizeof(pipeline));
+    pipes[npipes].kind = kind;
+    snprintf(pipes[npipes].name, sizeof(pipes[0].name), "%s", name);
+    npipes++;
+}
+
+/* exp_delay - exponential queueing delay with the given mean, plus a rare long stall */
+static double exp_delay(double mean) {
+    double d = -mean * log(1 - drand48());
+    if (drand48() < 0.05)
+        d += 10 * mean * drand48(); // a Wi-Fi retry burst
+    return d;
+}
+
+/* generate - write a synthetic trace with the true offset on every line */
+static void generate(int rounds, int m, double skew_ppm, double poll, double jitter_us) {
+    double t = 1.7e9, theta = 0.002, skew = skew_ppm * 1e-6;
+    double base = 0.5e-3, mean = jitter_us * 1e-6;
+    int r, i;
+
+    srand48(237);
+    for (r = 0; r < rounds; r++) {
+        printf("%f %d", t, m);
+        for (i = 0; i < m; i++) {
+            double fwd = base + exp_delay(mean), back = base + exp_delay(mean);
+            double offset = theta + (fwd - back) / 2;
+            printf(" %.9f %.9f", offset - (fwd + back) / 2, offset + (fwd + back) / 2);
+        }
+        printf(" %.9f\n", theta);
+        // the drift itself wanders a little from round to round
+        theta += skew * poll;
+        skew += 0.01e-6 * (drand48() - 0.5);
+        t += poll;
+    }
+}
+
+int main(int argc, char **argv) {
+    int MIN = 3, window = 8, rounds = 0, m_gen = 8, opt, k, j;
+    double skew_ppm = 20, poll = 32, jitter_us = 2000;
+    double q[MAX_PIPES][2];
+    int nq = 0;
+    int filters[MAX_PIPES][2];
+    int nf = 0;
+    char name[48];
+    FILE *fp;
+    char *line = NULL;
+    size_t cap = 0;
+    ntp_point *endpoints = NULL, *endpoint_scratch = NULL;
+    ntp_survivor *candidates = NULL, *survivors = NULL, *survivor_scratch = NULL;
+    int max_m = 0;
+    unsigned long nrounds = 0, skipped = 0;
+
+    while ((opt = getopt(argc, argv, "n:D:q:f:g:m:s:P:j:")) != -1) {
+        switch (opt) {
+        case 'n':
+            MIN = atoi(optarg);
+            break;
+        case 'D':
+            window = atoi(optarg);
+            break;
+        case 'q':
+            if (nq == MAX_PIPES - 2 || sscanf(optarg, "%lf:%lf", &q[nq][0], &q[nq][1]) != 2) {
+                fprintf(stderr, "bad process noise %s, want q_offset:q_skew\n", optarg);
+                exit(1);
+            }
+            nq++;
+            break;
+        case 'f':
+            filters[nf][1] = 8;
+            if (nf == MAX_PIPES - 3 || sscanf(optarg, "%d:%d", &filters[nf][0], &filters[nf][1]) < 1 ||
+                filters[nf][0] < 1 || filters[nf][1] < filters[nf][0] || filters[nf][1] > FILTER_STAGES_MAX) {
+                fprintf(stderr, "bad clock filter %s, want keep[:stages] with keep <= stages <= %d\n",
+                        optarg, FILTER_STAGES_MAX);
+                exit(1);
+            }
+            nf++;
+            break;
+        case 'g':
+            rounds = atoi(optarg);
+            break;
+        case 'm':
+            m_gen = atoi(optarg);
+            break;
+        case 's':
+            skew_ppm = atof(optarg);
+            break;
+        case 'P':
+            poll = atof(optarg);
+            break;
+        case 'j':
+            jitter_us = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n MIN] [-D rounds] [-q q_offset:q_skew]... [-f keep[:stages]]... <trace>\n"
+                            "       %s -g rounds [-m m] [-s ppm] [-P secs] [-j us] > trace\n", argv[0], argv[0]);
+            exit(1);
+        }
+    }
+    if (rounds > 0) {
+        if (m_gen < 1 || poll <= 0) {
+            fprintf(stderr, "need m >= 1 and a positive poll interval\n");
+            exit(1);
+        }
+        generate(rounds, m_gen, skew_ppm, poll, jitter_us);
+        return 0;
+    }
+    if (argc - optind != 1 || MIN < 1 || window < 2 || window > SKEW_WINDOW_MAX) {
+        fprintf(stderr, "usage: %s [-n MIN] [-D rounds] [-q q_offset:q_skew]... [-f keep[:stages]]... <trace>\n"
+                        "       %s -g rounds [-m m] [-s ppm] [-P secs] [-j us] > trace\n", argv[0], argv[0]);
+        exit(1);
+    }
+    if (nq == 0) {
+        q[0][0] = OKF_Q_OFFSET;
+        q[0][1] = OKF_Q_SKEW;
+        nq = 1;
+    }
+
+    add_pipe(PIPE_COMBINE, "combine");
+    snprintf(name, sizeof(name), "drift:%d", window);
+    add_pipe(PIPE_DRIFT, name);
+    skew_init(&pipes[1].fit, window);
+    for (k = 0; k < nq; k++) {
+        snprintf(name, sizeof(name), "kalman:%g:%g", q[k][0], q[k][1]);
+        add_pipe(PIPE_KALMAN, name);
+        okf_init(&pipes[npipes - 1].kf, q[k][0], q[k][1]);
+    }
+    for (k = 0; k < nf; k++) {
+        snprintf(name, sizeof(name), "filter:%d:%d", filters[k][0], filters[k][1]);
+        add_pipe(PIPE_FILTER, name);
+        filter_init(&pipes[npipes - 1].filter, filters[k][1]);
+        pipes[npipes - 1].keep = filters[k][0];
+    }
+    for (k = 0; k < nf; k++) {
+        for (j = 0; j < k && filters[j][0] != filters[k][0]; j++)
+            ;
+        if (j < k)
+            continue;
+        snprintf(name, sizeof(name), "filter:%d+kalman:%g:%g", filters[k][0], q[0][0], q[0][1]);
+        add_pipe(PIPE_FILTER_KALMAN, name);
+        filter_init(&pipes[npipes - 1].filter, FILTER_STAGES_MAX);
+        pipes[npipes - 1].keep = filters[k][0];
+        okf_init(&pipes[npipes - 1].kf, q[0][0], q[0][1]);
+    }
+
+    fp = fopen(argv[optind], "r");
+    if (fp == NULL)
+        error("Error opening the trace");
+    while (getline(&line, &cap, fp) > 0) {
+        char *p = line, *end;
+        double t, truth = NAN, reference;
+        int m, i, have_truth;
+
+        t = strtod(p, &end);
+        if (end == p)
+            continue;
+        p = end;
+        m = (int)strtol(p, &end, 10);
+        if (end == p || m < 1)
+            continue;
+        p = end;
+        if (m > max_m) {
+            // a clock filter can pass up to FILTER_STAGES_MAX samples on, whatever m is
+            int n = m > FILTER_STAGES_MAX ? m : FILTER_STAGES_MAX;
+            max_m = m;
+            endpoints = realloc(endpoints, 3*n*sizeof(ntp_point));
+            endpoint_scratch = realloc(endpoint_scratch, 3*n*sizeof(ntp_point));
+            candidates = realloc(candidates, n*sizeof(ntp_survivor));
+            survivors = realloc(survivors, n*sizeof(ntp_survivor));
+            survivor_scratch = realloc(survivor_scratch, n*sizeof(ntp_survivor));
+            if (!endpoints || !endpoint_scratch || !candidates || !survivors || !survivor_scratch)
+                error("Error allocating round buffers");
+        }
+        for (i = 0; i < m; i++) {
+            candidates[i].l = strtod(p, &end);
+            candidates[i].u = strtod(end, &p);
+            candidates[i].deviation = 0;
+            if (p == end)
+                break;
+        }
+        if (i < m || MIN > m) {
+            skipped++;
+            continue;
+        }
+        truth = strtod(p, &end);
+        have_truth = end != p;
+
+        // the reference for predictions: the truth, else what combine makes of this round
+        if (!have_truth) {
+            double l, u;
+            ntp_endpoints(endpoints, candidates, m);
+            if (ntp_combine(m, MIN, endpoints, endpoint_scratch, candidates, survivors, survivor_scratch,
+                            &reference, &l, &u) < 0) {
+                skipped++;
+                continue;
+            }
+        } else {
+            reference = truth;
+        }
+
+        for (k = 0; k < npipes; k++) {
+            pipeline *pp = &pipes[k];
+            double t0;
+            if (pp->have) {
+                double err = predict(pp, t) - reference;
+                pp->n_pred++;
+                pp->pred_abs += fabs(err);
+                pp->pred_sq += err * err;
+            }
+            t0 = mono_ns();
+            if (take_round(pp, t, m, MIN, endpoints, endpoint_scratch, candidates, survivors, survivor_scratch) < 0)
+                continue;
+            pp->ns += mono_ns() - t0;
+            pp->have = 1;
+            if (have_truth) {
+                double err = current(pp) - truth;
+                pp->n_est++;
+                pp->est_abs += fabs(err);
+                pp->est_sq += err * err;
+            }
+        }
+        nrounds++;
+    }
+    fclose(fp);
+
+    printf("%lu rounds, %lu skipped, predictions scored against %s\n", nrounds, skipped,
+           pipes[0].n_est ? "the true offset" : "combine");
+    printf("%-40s %12s %12s %12s %12s %10s\n", "pipeline", "pred mae us", "pred rmse us",
+           "est mae us", "est rmse us", "ns/round");
+    for (k = 0; k < npipes; k++) {
+        pipeline *pp = &pipes[k];
+        printf("%-40s %12.2f %12.2f", pp->name,
+               pp->n_pred ? 1e6 * pp->pred_abs / pp->n_pred : 0, pp->n_pred ? 1e6 * sqrt(pp->pred_sq / pp->n_pred) : 0);
+        if (pp->n_est)
+            printf(" %12.2f %12.2f", 1e6 * pp->est_abs / pp->n_est, 1e6 * sqrt(pp->est_sq / pp->n_est));
+        else
+            printf(" %12s %12s", "-", "-");
+        printf(" %10.0f\n", nrounds ? pp->ns / nrounds : 0);
+    }
+    free(line);
+    return 0;
+}
@@ -0,0 +1,539 @@
+/*
+ * syncd.c - clock sync and latency probe in one process
+ * usage: syncd [-m m] [-n MIN] [-K] [-e spec]... [-p bytes] [-P secs] <host> <udp port> <tcp port>
+ *   -m  samples per sync round (default 8)
+ *   -n  survivors kept by the clustering algorithm (default 3)
+ *   -K  take sync destination time-stamps from the kernel
+ *   -e  latency estimator, may be repeated (see estimator.h, default "jk")
+ *   -p  probe with a generated payload of this many bytes instead of send.png
+ *   -P  seconds between latency probes (default 1)
+ *
+ * Runs the udpclient sampler against udpserver and the tcpclient latency
+ * probe against tcpserver on one epoll loop. A single timerfd ticks once
+ * per probe period: every tick starts a probe, and every poll interval's
+ * worth of ticks also starts a sync round, so both jobs wake the process
+ * together instead of from two unaligned sleep loops. A second timerfd
+ * is armed only while a sync request is outstanding and resends it if
+ * the reply never comes.
+ *
+ * Latency is computed against the offset held in memory, updated the
+ * moment a round completes. result.txt is still written for anything
+ * else that reads it, but nothing here reads it back. If tcpserver drops
+ * the probe connection, probing stops and the sampler carries on.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "ntp.h"
+#include "offset_channel.h"
+#include "estimator.h"
+
+#define SYNC_TIMEOUT_MS 1000 // resend a sync request after this long without a reply
+
+#define FRAME_MAGIC 0x46524d31 // "FRM1"
+#define FRAME_LATENCY 1
+
+/* Frame header sent ahead of every payload */
+typedef struct{
+    uint32_t magic;  // FRAME_MAGIC
+    uint32_t type;   // FRAME_LATENCY
+    uint64_t size;   // payload bytes that follow
+} frame_header;
+
+/* Reply to a FRAME_LATENCY transfer; times are server wall clock in microseconds */
+typedef struct{
+    uint64_t t_finish;   // last payload byte arrived
+    uint64_t t_header;   // frame header arrived
+    uint64_t t_first;    // first payload byte arrived
+    uint64_t disk_us;    // server disk time
+    uint32_t crc;        // unused here, no CRC trailer is sent
+    uint32_t crc_status;
+} frame_reply;
+
+/* NTP-style sampler: one round of m exchanges, one request in flight at a time */
+typedef struct{
+    int fd;
+    int timerfd;                // retry timer for the outstanding request
+    struct sockaddr_in addr;
+    int m, MIN, kernel_stamps;
+    int active;                 // a round is in progress
+    int i;                      // samples collected this round
+    uint32_t org_s, org_f;      // originate time-stamp of the outstanding request
+    int poll_interval;          // seconds between rounds, doubled on a RATE kiss
+    int kod_backoff, kod_clean; // doublings owed to RATE kisses, undone one per KOD_RECOVER clean replies
+    unsigned long lost, stray;
+    ntp_arena arena;
+    ntp_point *endpoints, *endpoint_scratch;
+    ntp_survivor *candidates, *survivors, *survivor_scratch;
+    int have_offset;
+    double offset;              // latest combined offset, seconds
+    oc_writer chan;             // result.txt
+} sync_state;
+
+/* TCP latency probe: one payload in flight at a time */
+typedef struct{
+    int fd;
+    char *data;
+    uint64_t size;
+    int busy;
+    frame_header header;
+    uint64_t sent;              // bytes of header and payload written so far
+    frame_reply reply;
+    size_t got;                 // reply bytes read so far
+    int want_out;               // EPOLLOUT is armed
+    double t_send_header, t_start;
+    estimator est[EST_MAX];
+    int nest;
+    unsigned long overruns;     // ticks that found the previous probe still out
+    FILE *fp_latency;
+} probe_state;
+
+static int epfd;
+
+/*
+ * error - wrapper for perror
+ */
+void error(char *msg) {
+    perror(msg);
+    exit(0);
+}
+
+static double now_seconds(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+static void watch(int fd, uint32_t events, int op) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, op, fd, &ev) < 0)
+        error("ERROR on epoll_ctl");
+}
+
+static void arm_timer(int timerfd, long first_ms, long period_ms) {
+    struct itimerspec its;
+    its.it_value.tv_sec = first_ms / 1000;
+    its.it_value.tv_nsec = (first_ms % 1000) * 1000000;
+    its.it_interval.tv_sec = period_ms / 1000;
+    its.it_interval.tv_nsec = (period_ms % 1000) * 1000000;
+    if (timerfd_settime(timerfd, 0, &its, NULL) < 0)
+        error("ERROR arming timer");
+}
+
+/* load_payload - map send.png, or generate size bytes if size is non-zero */
+static void load_payload(probe_state *p, uint64_t size) {
+    struct stat fileInfo = {0};
+    uint64_t i, x = 88172645463325252ULL;
+    int fd;
+
+    if (size > 0) {
+        p->size = size;
+        p->data = malloc(size + 8);
+        if (p->data == NULL)
+            error("ERROR allocating payload");
+        for (i = 0; i < size; i += 8) {
+            x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+            memcpy(p->data + i, &x, 8);
+        }
+        return;
+    }
+    fd = open("send.png", O_RDONLY);
+    if (fd == -1)
+        error("ERROR open file");
+    if (fstat(fd, &fileInfo) == -1)
+        error("ERROR getting the file size");
+    p->size = fileInfo.st_size;
+    p->data = NULL;
+    if (p->size > 0) {
+        p->data = mmap(0, p->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p->data == MAP_FAILED)
+            error("ERROR mmapping file");
+    }
+    close(fd);
+}
+
+/* sync_send - send the next request of the round and start its retry timer */
+static void sync_send(sync_state *s) {
+    ntp_packet packet = { 0 };
+    struct timeval tv;
+
+    packet.li_vn_mode = (NTP_VERSION << 3) | NTP_MODE_CLIENT;
+    gettimeofday(&tv, NULL);
+    packet.origTm_s = s->org_s = (uint32_t)tv.tv_sec;
+    packet.origTm_f = s->org_f = (uint32_t)tv.tv_usec;
+    if (sendto(s->fd, &packet, sizeof(packet), 0, (struct sockaddr *)&s->addr, sizeof(s->addr)) < 0)
+        error("ERROR in sendto");
+    arm_timer(s->timerfd, SYNC_TIMEOUT_MS, 0);
+}
+
+static void sync_start(sync_state *s) {
+    s->active = 1;
+    s->i = 0;
+    sync_send(s);
+}
+
+/* sync_finish - combine the round into the in-memory offset */
+static void sync_finish(sync_state *s) {
+    double estimate, l, u;
+
+    s->active = 0;
+    arm_timer(s->timerfd, 0, 0);
+    if (ntp_combine(s->m, s->MIN, s->endpoints, s->endpoint_scratch, s->candidates,
+                    s->survivors, s->survivor_scratch, &estimate, &l, &u) < 0) {
+        printf("sync: no majority clique this round\n");
+        return;
+    }
+    s->offset = estimate;
+    s->have_offset = 1;
+    // readers waiting on the channel wake as soon as it is stored
+    oc_publish(&s->chan, now_seconds(), estimate, (u - l)/2, 0, 0);
+    printf("sync: [%f, %f] offset %f, %lu lost, %lu stray replies\n", l, u, estimate, s->lost, s->stray);
+}
+
+/* sync_receive - fold every queued reply that answers the outstanding request */
+static void sync_receive(sync_state *s) {
+    ntp_packet packet;
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    struct timeval tv, rx_stamp;
+    int n, stamped, i;
+
+    while (1) {
+        fromlen = sizeof(from);
+        n = recv_stamped(s->fd, &packet, sizeof(packet), &from, &fromlen, &rx_stamp, &stamped);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            // an ICMP error for an earlier request; the retry timer resends
+            if (errno == ECONNREFUSED)
+                continue;
+            error("ERROR in recvfrom");
+        }
+        gettimeofday(&tv, NULL);
+        if (stamped)
+            tv = rx_stamp;
+        if (!s->active || n < (int)sizeof(packet) ||
+            packet.origTm_s != s->org_s || packet.origTm_f != s->org_f) {
+            s->stray++;
+            continue;
+        }
+        if (packet.stratum == 0 && ntohl(packet.refId) == KOD_RATE) {
+            if (s->poll_interval < POLL_MAX) {
+                s->poll_interval *= 2;
+                s->kod_backoff++;
+            }
+            s->kod_clean = 0;
+            printf("sync: server sent RATE kiss, poll interval now %d s\n", s->poll_interval);
+            s->active = 0;
+            arm_timer(s->timerfd, 0, 0);
+            return;
+        }
+        if (s->kod_backoff > 0 && ++s->kod_clean == KOD_RECOVER) {
+            s->poll_interval = s->poll_interval/2 > POLL_MIN ? s->poll_interval/2 : POLL_MIN;
+            s->kod_backoff--;
+            s->kod_clean = 0;
+            printf("sync: no RATE kiss for %d replies, poll interval back to %d s\n", KOD_RECOVER, s->poll_interval);
+        }
+        /* a relay before its first round, or any other kiss, has no time to give */
+        if (ntp_unsynchronised(&packet)) {
+            printf("sync: server is not synchronised (stratum %u), skipping the round\n", packet.stratum);
+            s->active = 0;
+            arm_timer(s->timerfd, 0, 0);
+            return;
+        }
+
+        double t_org = (double)packet.origTm_s + packet.origTm_f/1000000.0;
+        double t_rec = (double)packet.rxTm_s + packet.rxTm_f/1000000.0;
+        double t_xmt = (double)packet.txTm_s + packet.txTm_f/1000000.0;
+        double t_dst = (double)tv.tv_sec + tv.tv_usec/1000000.0;
+        double RTT = (t_dst - t_org) - (t_xmt - t_rec);
+        double offset = ((t_rec - t_org) + (t_xmt - t_dst))/2;
+
+        i = s->i++;
+        ntp_sample_bounds(&packet, offset, RTT, &s->candidates[i].l, &s->candidates[i].u);
+        s->endpoints[i].type = 0;
+        s->endpoints[i].value = s->candidates[i].l;
+        s->endpoints[i + s->m].type = 1;
+        s->endpoints[i + s->m].value = offset;
+        s->endpoints[i + 2*s->m].type = 2;
+        s->endpoints[i + 2*s->m].value = s->candidates[i].u;
+        if (s->i == s->m)
+            sync_finish(s);
+        else
+            sync_send(s);
+    }
+}
+
+/* probe_lost - the server went away: stop probing, keep syncing */
+static void probe_lost(probe_state *p, const char *why) {
+    printf("probe: %s, latency probing stopped\n", why);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+    close(p->fd);
+    p->fd = -1;
+    p->busy = 0;
+}
+
+/*
+ * probe_flush - write as much of the frame as the socket takes; 1 once it
+ * is all out, -1 if the connection is gone. The header goes out on its
+ * own and t_start is taken as it completes, just before the first payload
+ * byte, the same point tcpclient stamps.
+ */
+static int probe_flush(probe_state *p) {
+    uint64_t total = sizeof(p->header) + p->size;
+    ssize_t n;
+
+    while (p->sent < total) {
+        if (p->sent < sizeof(p->header))
+            n = send(p->fd, (char *)&p->header + p->sent, sizeof(p->header) - p->sent, MSG_NOSIGNAL);
+        else
+            n = send(p->fd, p->data + (p->sent - sizeof(p->header)), total - p->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            probe_lost(p, strerror(errno));
+            return -1;
+        }
+        if (p->sent < sizeof(p->header) && p->sent + n == sizeof(p->header))
+            p->t_start = now_seconds();
+        p->sent += n;
+    }
+    return 1;
+}
+
+static void probe_start(probe_state *p) {
+    int done;
+
+    p->busy = 1;
+    p->sent = 0;
+    p->got = 0;
+    p->header.magic = FRAME_MAGIC;
+    p->header.type = FRAME_LATENCY;
+    p->header.size = p->size;
+    p->t_send_header = now_seconds();
+    done = probe_flush(p);
+    if (done == 0 && !p->want_out) {
+        watch(p->fd, EPOLLIN | EPOLLOUT, EPOLL_CTL_MOD);
+        p->want_out = 1;
+    }
+}
+
+static void probe_writable(probe_state *p) {
+    if (p->busy && probe_flush(p) == 1 && p->want_out) {
+        watch(p->fd, EPOLLIN, EPOLL_CTL_MOD);
+        p->want_out = 0;
+    }
+}
+
+/*
+ * probe_readable - collect the reply and turn it into a latency sample.
+ * Between probes there is no reply to wait for: anything readable is
+ * drained, and EOF or an error means the server is gone, not a sample.
+ */
+static void probe_readable(probe_state *p, const sync_state *s) {
+    char scratch[256];
+    ssize_t n;
+    int k;
+
+    if (p->fd < 0)
+        return;
+    if (!p->busy) {
+        while ((n = read(p->fd, scratch, sizeof(scratch))) > 0)
+            ;
+        if (n == 0)
+            probe_lost(p, "server closed the connection");
+        else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            probe_lost(p, strerror(errno));
+        return;
+    }
+    while (p->got < sizeof(p->reply)) {
+        n = read(p->fd, (char *)&p->reply + p->got, sizeof(p->reply) - p->got);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            probe_lost(p, n == 0 ? "server closed the connection" : strerror(errno));
+            return;
+        }
+        p->got += n;
+    }
+    p->busy = 0;
+    double latency = p->reply.t_finish/1000000.0 - p->t_start - s->offset;
+    double header_delay = p->reply.t_header/1000000.0 - s->offset - p->t_send_header;
+    fprintf(p->fp_latency, "%f", latency);
+    for (k = 0; k < p->nest; k++) {
+        est_sample(&p->est[k], latency);
+        fprintf(p->fp_latency, " %f %f %f", p->est[k].pred, p->est[k].up, p->est[k].last_err);
+    }
+    fprintf(p->fp_latency, "\n");
+    fflush(p->fp_latency);
+    printf("Latency is %f (header %f), %s next %f, y_up is %f, error %f\n", latency, header_delay,
+           p->est[0].spec, p->est[0].pred, p->est[0].up, p->est[0].last_err);
+}
+
+int main(int argc, char **argv) {
+    sync_state sync;
+    probe_state probe;
+    struct hostent *server;
+    struct sockaddr_in tcpaddr;
+    struct epoll_event events[4];
+    uint64_t synthetic_size = 0, expirations;
+    unsigned long ticks = 0, next_round = 0;
+    double period = 1;
+    int tickfd, opt, n, k, optval = 1;
+
+    memset(&sync, 0, sizeof(sync));
+    memset(&probe, 0, sizeof(probe));
+    sync.m = 8;
+    sync.MIN = 3;
+    sync.poll_interval = POLL_MIN;
+    while ((opt = getopt(argc, argv, "m:n:Ke:p:P:")) != -1) {
+        switch (opt) {
+        case 'm':
+            sync.m = atoi(optarg);
+            break;
+        case 'n':
+            sync.MIN = atoi(optarg);
+            break;
+        case 'K':
+            sync.kernel_stamps = 1;
+            break;
+        case 'e':
+            if (probe.nest == EST_MAX || est_init(&probe.est[probe.nest], optarg) < 0) {
+                fprintf(stderr, "bad estimator spec %s, or more than %d\n", optarg, EST_MAX);
+                exit(0);
+            }
+            probe.nest++;
+            break;
+        case 'p':
+            synthetic_size = strtoull(optarg, NULL, 0);
+            break;
+        case 'P':
+            period = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-m m] [-n MIN] [-K] [-e spec]... [-p bytes] [-P secs] <hostname> <udp port> <tcp port>\n", argv[0]);
+            exit(0);
+        }
+    }
+    if (argc - optind != 3) {
+        fprintf(stderr, "usage: %s [-m m] [-n MIN] [-K] [-e spec]... [-p bytes] [-P secs] <hostname> <udp port> <tcp port>\n", argv[0]);
+        exit(0);
+    }
+    if (sync.m <= 0 || sync.MIN <= 0 || sync.MIN > sync.m || sync.m > NTP_M_MAX || period < 0.001) {
+        fprintf(stderr, "ERROR, need 0 < MIN <= m <= %d and a probe period of at least 1 ms\n", NTP_M_MAX);
+        exit(0);
+    }
+    if (probe.nest == 0)
+        est_init(&probe.est[probe.nest++], "jk");
+
+    server = gethostbyname(argv[optind]);
+    if (server == NULL) {
+        fprintf(stderr, "ERROR, no such host as %s\n", argv[optind]);
+        exit(0);
+    }
+    bzero((char *)&sync.addr, sizeof(sync.addr));
+    sync.addr.sin_family = AF_INET;
+    bcopy((char *)server->h_addr, (char *)&sync.addr.sin_addr.s_addr, server->h_length);
+    tcpaddr = sync.addr;
+    sync.addr.sin_port = htons(atoi(argv[optind + 1]));
+    tcpaddr.sin_port = htons(atoi(argv[optind + 2]));
+
+    /* sampler: non-blocking UDP socket and the round's buffers */
+    sync.fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sync.fd < 0)
+        error("ERROR opening socket");
+    if (sync.kernel_stamps && enable_rx_timestamps(sync.fd) < 0)
+        error("ERROR enabling receive time-stamps");
+    arena_init(&sync.arena, arena_bytes(sync.m), 0);
+    sync.endpoints = arena_alloc(&sync.arena, 3*sync.m*sizeof(ntp_point));
+    sync.endpoint_scratch = arena_alloc(&sync.arena, 3*sync.m*sizeof(ntp_point));
+    sync.candidates = arena_alloc(&sync.arena, sync.m*sizeof(ntp_survivor));
+    sync.survivors = arena_alloc(&sync.arena, sync.m*sizeof(ntp_survivor));
+    sync.survivor_scratch = arena_alloc(&sync.arena, sync.m*sizeof(ntp_survivor));
+
+    if (oc_writer_open(&sync.chan, "result.txt") == -1)
+        error("Error opening result.txt");
+
+    /* probe: connect blocking, then switch the socket to non-blocking */
+    load_payload(&probe, synthetic_size);
+    printf("Image size is: %llu\n", (unsigned long long)probe.size);
+    probe.fp_latency = fopen("latency.txt", "a+");
+    if (probe.fp_latency == NULL)
+        error("ERROR opening latency.txt");
+    probe.fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (probe.fd < 0)
+        error("ERROR opening socket");
+    setsockopt(probe.fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    if (connect(probe.fd, (struct sockaddr *)&tcpaddr, sizeof(tcpaddr)) < 0)
+        error("ERROR connecting");
+    fcntl(probe.fd, F_SETFL, fcntl(probe.fd, F_GETFL) | O_NONBLOCK);
+
+    /* one tick drives both jobs; the retry timer only runs mid-round */
+    epfd = epoll_create1(0);
+    tickfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    sync.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (epfd < 0 || tickfd < 0 || sync.timerfd < 0)
+        error("ERROR creating epoll or timers");
+    watch(tickfd, EPOLLIN, EPOLL_CTL_ADD);
+    watch(sync.timerfd, EPOLLIN, EPOLL_CTL_ADD);
+    watch(sync.fd, EPOLLIN, EPOLL_CTL_ADD);
+    watch(probe.fd, EPOLLIN, EPOLL_CTL_ADD);
+    arm_timer(tickfd, 1, (long)(period * 1000));
+
+    while (1) {
+        n = epoll_wait(epfd, events, 4, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            error("ERROR in epoll_wait");
+        }
+        for (k = 0; k < n; k++) {
+            int efd = events[k].data.fd;
+            if (efd == tickfd) {
+                if (read(tickfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                    continue;
+                ticks += expirations;
+                // rounds land on ticks so they share the probe's wake-up
+                if (ticks >= next_round && !sync.active) {
+                    sync_start(&sync);
+                    next_round = ticks + (unsigned long)ceil(sync.poll_interval / period);
+                }
+                // a probe needs an offset to mean anything
+                if (probe.busy)
+                    probe.overruns++;
+                else if (sync.have_offset && probe.fd >= 0)
+                    probe_start(&probe);
+            } else if (efd == sync.timerfd) {
+                if (read(sync.timerfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                    continue;
+                if (sync.active) {
+                    sync.lost++;
+                    sync_send(&sync);
+                }
+            } else if (efd == sync.fd) {
+                sync_receive(&sync);
+            } else if (efd == probe.fd) {
+                if (events[k].events & EPOLLOUT)
+                    probe_writable(&probe);
+                if (events[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    probe_readable(&probe, &sync);
+            }
+        }
+    }
+    return 0;
+}
@@ -1,6 +1,32 @@
 /*
  * tcpclient.c - A simple TCP client
- * usage: tcpclient <host> <port>
+ * usage: tcpclient [-e spec]... [-p bytes] [-N stripes] [-C] [-T [-c conns] [-t secs] [-s bytes] [-w bytes]]
+ *                  [-S [-z min:max]] [-O mode] <host> <port>
+ *   -e  latency estimator to run, may be repeated; all of them see the
+ *       same samples and the first one is printed (see estimator.h,
+ *       default "jk")
+ *   -p  send a generated payload of this many bytes instead of send.png
+ *   -N  split every payload into this many stripes, each sent on its own
+ *       connection in parallel (default 1, the whole payload on one)
+ *   -C  follow every payload (or stripe) with its CRC32C; samples the
+ *       server received damaged are flagged in breakdown.txt and kept
+ *       out of latency.txt and the estimators
+ *   -T  throughput mode: stream over -c connections (default 1) for -t
+ *       seconds (default 10) or until -s bytes per connection have gone
+ *       (default 0, no limit), in writes of -w bytes (default 65536), then
+ *       report goodput, retransmits and CPU utilisation
+ *   -S  size sweep: cycle generated payloads from -z min:max bytes
+ *       (default 64:16777216, doubling) and fit latency = a + size/b,
+ *       printing and logging the base latency a and bandwidth b to
+ *       sweep.txt as they move
+ *   -O  take one sample each time udpclient publishes a new offset,
+ *       sleeping on it with futex, eventfd, inotify or poll (see
+ *       offset_channel.h), instead of one sample a second
+ *
+ * Every sample prints the generation of the latest offset, marked stale
+ * when no new offset has been published since the last sample. Server
+ * time-stamps are converted with the offset interpolated at their own
+ * instant from the history udpclient publishes (offset_channel.h).
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,8 +41,91 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include "estimator.h"
+#include "crc32c.h"
+#include "offset_channel.h"
 
-#define BUFSIZE 1024*4
+#define MAX_CONNS 64
+
+#define FRAME_MAGIC 0x46524d31 // "FRM1"
+#define FRAME_LATENCY 1
+#define FRAME_STREAM 2
+#define FRAME_STRIPE 3
+#define FRAME_CRC 0x100  // flag on the type: a CRC32C of the payload follows it
+
+#define CRC_NONE 0       // frame_reply.crc_status: no trailer was sent
+#define CRC_OK 1
+#define CRC_BAD 2
+#define CRC_SLICE (1024*1024) // bytes checksummed just ahead of each write
+
+/* Frame header sent ahead of every payload */
+typedef struct{
+    uint32_t magic;  // FRAME_MAGIC
+    uint32_t type;   // FRAME_LATENCY, FRAME_STREAM or FRAME_STRIPE, optionally with FRAME_CRC set
+    uint64_t size;   // payload (or stripe) bytes that follow, unused for FRAME_STREAM
+} frame_header;
+
+/* Follows a FRAME_STRIPE header: which piece of which transfer this is */
+typedef struct{
+    uint64_t transfer;  // id shared by every stripe of one payload
+    uint64_t offset;    // where this stripe lands in the payload
+    uint64_t total;     // size of the whole payload
+    uint32_t count;     // stripes the payload was split into
+    uint32_t pad;
+} stripe_header;
+
+#define FIT_FORGET 0.99 // weight older samples keep each time a new one arrives
+
+/* online least-squares fit of latency = a + size/b */
+typedef struct{
+    double n, sx, sy, sxx, sxy; // exponentially forgotten sums
+    double a;                   // base latency, seconds
+    double b;                   // effective bandwidth, bytes per second (0 until known)
+} size_fit;
+
+/* Reply to a FRAME_LATENCY transfer; times are server wall clock in microseconds */
+typedef struct{
+    uint64_t t_finish;   // last payload byte arrived
+    uint64_t t_header;   // frame header arrived
+    uint64_t t_first;    // first payload byte arrived
+    uint64_t disk_us;    // time the server spent blocked writing the payload to disk
+    uint32_t crc;        // CRC32C of the payload as the server received it, if checked
+    uint32_t crc_status; // CRC_NONE, CRC_OK or CRC_BAD
+} frame_reply;
+
+/*
+ * Payload provider: a payload is loaded or generated once and its buffer
+ * stays put, so send paths can hand it to write() every iteration
+ * without touching the filesystem.
+ */
+typedef struct{
+    char *data;
+    uint64_t size;
+    int mapped;  // 1 if data maps a file, 0 if it was generated
+} payload;
+
+/* one connection of a throughput run */
+typedef struct{
+    struct sockaddr_in *serveraddr;
+    payload *payload;          // source of every write, at least chunk bytes
+    double duration;           // seconds to stream for
+    uint64_t limit;            // bytes to stream, 0 for no limit
+    size_t chunk;              // bytes per write
+    uint64_t sent;             // bytes accepted by the socket
+    unsigned retrans;          // segments retransmitted, from TCP_INFO
+} stream_job;
+
+/* one stripe of a striped latency transfer */
+typedef struct{
+    int sockfd;
+    frame_header header;
+    stripe_header stripe;
+    const char *data;          // first byte of this stripe in the payload
+    int check;                 // send a CRC trailer
+} stripe_job;
 
 /*
  * error - wrapper for perror
@@ -26,82 +135,461 @@ void error(char *msg) {
     exit(0);
 }
 
-void estimiating(double *y_s, double *y_var, double *y_i, double *y_up){
-	double alpha = 0.7;
-    double beta = 0.7;
-	double kappa = 0.7;
-	*y_var = (1 - beta) * (*y_var) + beta * abs(*y_s - *y_i);
-	*y_s = (1 - alpha) * (*y_s) + alpha * (*y_i);
-	*y_up = *y_s + kappa * (*y_var);
+static double now_seconds(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + tv.tv_usec/1000000.0;
 }
 
-double get_offset(){
-    const char *filepath = "result.txt";
-    int fd = open(filepath, O_RDONLY, (mode_t)0600);
-    
-    if (fd == -1)
-    {
-        perror("Error opening file for writing");
-        exit(EXIT_FAILURE);
+/*
+ * open_connection - socket + connect to the server, exits on failure.
+ * Nagle is turned off: otherwise the tail of a payload waits for the
+ * server's delayed ACK and every sample carries ~40 ms of timer.
+ */
+int open_connection(struct sockaddr_in *serveraddr) {
+    int optval = 1;
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0)
+        error("ERROR opening socket");
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    if (connect(sockfd, (struct sockaddr *)serveraddr, sizeof(*serveraddr)) < 0)
+        error("ERROR connecting");
+    return sockfd;
+}
+
+/* read_reply - read a whole frame_reply, exits on failure */
+void read_reply(int sockfd, frame_reply *reply) {
+    size_t got = 0;
+    int n;
+    while (got < sizeof(*reply)) {
+        n = read(sockfd, (char *)reply + got, sizeof(*reply) - got);
+        if (n <= 0)
+            error("ERROR reading from socket");
+        got += n;
     }
-    
+}
+
+/* write_full - write all len bytes, exits on failure */
+void write_full(int sockfd, const void *buf, size_t len) {
+    size_t done = 0;
+    int n;
+    while (done < len) {
+        n = write(sockfd, (const char *)buf + done, len - done);
+        if (n < 0)
+            error("ERROR writing to socket");
+        done += n;
+    }
+}
+
+/*
+ * write_payload - write len bytes and, if check is set, their CRC32C
+ * trailer. The CRC is folded in a slice at a time just before the slice
+ * is written, so each byte is read once while it is still in cache.
+ */
+void write_payload(int sockfd, const char *data, uint64_t len, int check) {
+    uint32_t crc = crc32c_begin();
+    uint64_t done, slice;
+
+    if (!check) {
+        write_full(sockfd, data, len);
+        return;
+    }
+    for (done = 0; done < len; done += slice) {
+        slice = len - done < CRC_SLICE ? len - done : CRC_SLICE;
+        crc = crc32c_update(crc, data + done, slice);
+        write_full(sockfd, data + done, slice);
+    }
+    crc = crc32c_end(crc);
+    write_full(sockfd, &crc, sizeof(crc));
+}
+
+/* payload_from_file - map path read-only and fault it in once */
+void payload_from_file(payload *p, const char *path) {
     struct stat fileInfo = {0};
-    
+    int flags = MAP_PRIVATE;
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+        error("ERROR open file");
     if (fstat(fd, &fileInfo) == -1)
-    {
-        perror("Error getting the file size");
-        exit(EXIT_FAILURE);
+        error("ERROR getting the file size");
+    p->size = fileInfo.st_size;
+    p->mapped = 1;
+    p->data = NULL;
+    if (p->size > 0) {
+#ifdef MAP_POPULATE
+        flags |= MAP_POPULATE;
+#endif
+        p->data = mmap(0, p->size, PROT_READ, flags, fd, 0);
+        if (p->data == MAP_FAILED)
+            error("ERROR mmapping file");
     }
-    
-    if (fileInfo.st_size == 0)
-    {
-        fprintf(stderr, "Error: File is empty, nothing to do\n");
-        exit(EXIT_FAILURE);
+    close(fd);
+}
+
+/* payload_synthetic - generate size bytes of incompressible payload */
+void payload_synthetic(payload *p, uint64_t size) {
+    uint64_t i, x = 88172645463325252ULL;
+
+    p->size = size;
+    p->mapped = 0;
+    p->data = malloc(size + 8);
+    if (p->data == NULL)
+        error("ERROR allocating payload");
+    // xorshift fill, so nothing on the path can compress the payload
+    for (i = 0; i < size; i += 8) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        memcpy(p->data + i, &x, 8);
     }
-    
-    printf("File size is %ji\n", (intmax_t)fileInfo.st_size);
-    
-    double *map = mmap(0, fileInfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
-    if (map == MAP_FAILED)
-    {
-        close(fd);
-        perror("Error mmapping the file");
-        exit(EXIT_FAILURE);
+}
+
+void payload_release(payload *p) {
+    if (p->mapped && p->data != NULL)
+        munmap(p->data, p->size);
+    else if (!p->mapped)
+        free(p->data);
+    p->data = NULL;
+}
+
+/* fit_add - fold one (size, latency) sample into the fit and refresh a and b */
+void fit_add(size_fit *f, double size, double latency) {
+    double det, slope;
+
+    f->n = FIT_FORGET * f->n + 1;
+    f->sx = FIT_FORGET * f->sx + size;
+    f->sy = FIT_FORGET * f->sy + latency;
+    f->sxx = FIT_FORGET * f->sxx + size * size;
+    f->sxy = FIT_FORGET * f->sxy + size * latency;
+    det = f->n * f->sxx - f->sx * f->sx;
+    if (det <= 0)
+        return; // all samples so far share one size
+    slope = (f->n * f->sxy - f->sx * f->sy) / det;
+    f->a = (f->sy - slope * f->sx) / f->n;
+    f->b = slope > 0 ? 1 / slope : 0;
+}
+
+/* stream_worker - push one throughput stream and collect its counters */
+void *stream_worker(void *arg) {
+    stream_job *job = arg;
+    frame_header header = { FRAME_MAGIC, FRAME_STREAM, 0 };
+    char *buf = job->payload->data;
+    int sockfd = open_connection(job->serveraddr);
+    double deadline = now_seconds() + job->duration;
+    int n;
+
+    if (write(sockfd, &header, sizeof(header)) < 0)
+        error("ERROR writing to socket");
+    while (now_seconds() < deadline && (job->limit == 0 || job->sent < job->limit)) {
+        size_t len = job->limit && job->limit - job->sent < job->chunk ? job->limit - job->sent : job->chunk;
+        n = write(sockfd, buf, len);
+        if (n < 0)
+            error("ERROR writing to socket");
+        job->sent += n;
     }
-    
-    double offset = map[0];
-    // Don't forget to free the mmapped memory
-    if (munmap(map, fileInfo.st_size) == -1)
-    {
-        close(fd);
-        perror("Error un-mmapping the file");
-        exit(EXIT_FAILURE);
-    }
-    // Un-mmaping doesn't close the file, so we still need to do that.
-    close(fd);
+#ifdef __linux__
+    struct tcp_info info;
+    socklen_t infolen = sizeof(info);
+    if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &infolen) == 0)
+        job->retrans = info.tcpi_total_retrans;
+#endif
+    // Wait for the server to drain everything before the clock stops
+    shutdown(sockfd, SHUT_WR);
+    char drain[64];
+    while (read(sockfd, drain, sizeof(drain)) > 0)
+        ;
+    close(sockfd);
+    return NULL;
+}
+
+/* run_throughput - stream over nconns connections at once and report the totals */
+void run_throughput(struct sockaddr_in *serveraddr, int nconns, double duration,
+                    uint64_t limit, size_t chunk) {
+    stream_job jobs[MAX_CONNS];
+    pthread_t threads[MAX_CONNS];
+    payload source;
+    struct rusage ru;
+    uint64_t total = 0;
+    unsigned retrans = 0;
+    double start, elapsed, cpu;
+    int i;
+
+    // every stream only reads the payload, so they all share one
+    payload_synthetic(&source, chunk);
+    memset(jobs, 0, sizeof(jobs));
+    start = now_seconds();
+    for (i = 0; i < nconns; i++) {
+        jobs[i].serveraddr = serveraddr;
+        jobs[i].payload = &source;
+        jobs[i].duration = duration;
+        jobs[i].limit = limit;
+        jobs[i].chunk = chunk;
+        if (pthread_create(&threads[i], NULL, stream_worker, &jobs[i]) != 0)
+            error("ERROR creating stream thread");
+    }
+    for (i = 0; i < nconns; i++) {
+        pthread_join(threads[i], NULL);
+        total += jobs[i].sent;
+        retrans += jobs[i].retrans;
+        printf("conn %d: %llu bytes, %u retransmits\n", i, (unsigned long long)jobs[i].sent, jobs[i].retrans);
+    }
+    elapsed = now_seconds() - start;
+    getrusage(RUSAGE_SELF, &ru);
+    cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1000000.0
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1000000.0;
+    printf("goodput: %llu bytes in %.3f s over %d connections = %.2f Mbit/s\n",
+           (unsigned long long)total, elapsed, nconns, total * 8 / elapsed / 1e6);
+    printf("retransmits: %u, cpu: %.1f%% of one core\n", retrans, 100 * cpu / elapsed);
+    payload_release(&source);
+}
+
+double get_offset();
+double server_offset(double t_server, double *bound);
+
+static oc_reader offset_chan;  // result.txt, published by udpclient or syncd
+static uint32_t offset_gen;    // generation get_offset() last returned
+static int wait_mode = -1;     // -O, or -1 to sample once a second
+
+static void *stripe_worker(void *arg) {
+    stripe_job *job = arg;
+    write_full(job->sockfd, &job->header, sizeof(job->header));
+    write_full(job->sockfd, &job->stripe, sizeof(job->stripe));
+    write_payload(job->sockfd, job->data, job->header.size, job->check);
+    return NULL;
+}
+
+/*
+ * send_striped - split the payload into one stripe per connection, send
+ * them in parallel and collect the reply, which the server only sends
+ * once the last stripe has landed
+ */
+void send_striped(int *fds, int nstripes, const payload *pl, uint64_t transfer, int check,
+                  frame_reply *reply) {
+    stripe_job jobs[MAX_CONNS];
+    pthread_t threads[MAX_CONNS];
+    frame_reply other;
+    int i;
+
+    for (i = 0; i < nstripes; i++) {
+        uint64_t lo = pl->size * i / nstripes, hi = pl->size * (i + 1) / nstripes;
+        jobs[i].sockfd = fds[i];
+        jobs[i].header.magic = FRAME_MAGIC;
+        jobs[i].header.type = FRAME_STRIPE | (check ? FRAME_CRC : 0);
+        jobs[i].header.size = hi - lo;
+        jobs[i].stripe.transfer = transfer;
+        jobs[i].stripe.offset = lo;
+        jobs[i].stripe.total = pl->size;
+        jobs[i].stripe.count = nstripes;
+        jobs[i].stripe.pad = 0;
+        jobs[i].data = pl->data + lo;
+        jobs[i].check = check;
+    }
+    // the calling thread sends stripe 0 while the others go out beside it
+    for (i = 1; i < nstripes; i++)
+        if (pthread_create(&threads[i], NULL, stripe_worker, &jobs[i]) != 0)
+            error("ERROR creating stripe thread");
+    stripe_worker(&jobs[0]);
+    for (i = 1; i < nstripes; i++)
+        pthread_join(threads[i], NULL);
+
+    // every connection gets the same reply for the whole transfer
+    read_reply(fds[0], reply);
+    for (i = 1; i < nstripes; i++)
+        read_reply(fds[i], &other);
+}
+
+/*
+ * run_sweep - send generated payloads of every size from min to max in
+ * turn, iterations times, fitting latency against size as samples land
+ */
+void run_sweep(int sockfd, uint64_t min, uint64_t max, int iterations, int check) {
+    FILE *fp_sweep = fopen("sweep.txt", "a+");
+    payload source;
+    size_fit fit;
+    uint64_t size = min;
+    int timer;
+
+    if (fp_sweep == NULL)
+        error("ERROR opening sweep.txt");
+    // every size is a prefix of one payload of the largest size
+    payload_synthetic(&source, max);
+    memset(&fit, 0, sizeof(fit));
+
+    for (timer = 0; timer < iterations; timer++) {
+        frame_header header = { FRAME_MAGIC, FRAME_LATENCY | (check ? FRAME_CRC : 0), size };
+        struct timeval tv_start;
+        frame_reply reply;
+
+        write_full(sockfd, &header, sizeof(header));
+        gettimeofday(&tv_start, NULL);
+        write_payload(sockfd, source.data, size, check);
+        read_reply(sockfd, &reply);
+
+        get_offset();
+        double latency = reply.t_finish/1000000.0 - ((double)tv_start.tv_sec + tv_start.tv_usec/1000000.0) -
+                         server_offset(reply.t_finish/1000000.0, NULL);
+        if (reply.crc_status == CRC_BAD) {
+            printf("CRC mismatch: server received %08x, sample %f not used\n", reply.crc, latency);
+        } else {
+            fit_add(&fit, size, latency);
+            printf("size %llu latency %f: base latency %f s, bandwidth %.2f Mbit/s\n",
+                   (unsigned long long)size, latency, fit.a, fit.b * 8 / 1e6);
+            fprintf(fp_sweep, "%llu %f %f %f\n", (unsigned long long)size, latency, fit.a, fit.b);
+            fflush(fp_sweep);
+        }
+
+        size = size * 2 <= max ? size * 2 : min;
+        sleep(1);
+    }
+    if (fit.b > 0)
+        printf("predicted transfer time: %f s + size / %.0f B/s\n", fit.a, fit.b);
+    fclose(fp_sweep);
+    payload_release(&source);
+}
+
+/* get_offset - the latest published offset, noting whether it is new since the last call */
+double get_offset(){
+    double offset;
+    uint32_t gen = oc_read(&offset_chan, &offset, NULL);
+
+    printf("offset %f, generation %u%s\n", offset, gen, gen == offset_gen ? " (stale)" : "");
+    offset_gen = gen;
+    return offset;
+}
+
+/*
+ * offset_at - the offset at local time t, from the published history
+ * when the writer keeps one, else the latest
+ */
+static double offset_at(double t, double *bound) {
+    double offset, b = 0;
+
+    if (oc_offset_at(&offset_chan, t, &offset, &b) == 0)
+        oc_read(&offset_chan, &offset, NULL);
+    if (bound != NULL)
+        *bound = b;
     return offset;
 }
 
+/*
+ * server_offset - the offset at the moment the server clock read t_server;
+ * the latest offset places that moment on the local clock closely enough,
+ * since the offset moves by microseconds between publishes
+ */
+double server_offset(double t_server, double *bound) {
+    double latest;
+
+    oc_read(&offset_chan, &latest, NULL);
+    return offset_at(t_server - latest, bound);
+}
+
+/* next_sample - sleep a second, or with -O until the next offset lands */
+static void next_sample(void) {
+    uint32_t gen = offset_gen;
+
+    // a wait that fails still sleeps, so samples never go out back to back
+    if (wait_mode < 0 || oc_wait(&offset_chan, &gen, -1) < 0)
+        sleep(1);
+}
+
 int main(int argc, char **argv) {
     int sockfd, portno, n;
     struct sockaddr_in serveraddr;
     struct hostent *server;
     char *hostname;
-    char buf[BUFSIZE];
-    double y_s, y_var, y_up;
+    estimator est[EST_MAX];
+    int nest = 0;
+    int opt, k;
+    // throughput mode
+    int throughput = 0, nconns = 1;
+    double duration = 10;
+    uint64_t limit = 0;
+    size_t chunk = 65536;
+    // latency mode payload
+    payload source;
+    uint64_t synthetic_size = 0;
+    int stripe_fds[MAX_CONNS];
+    int nstripes = 1;
+    int check = 0;
+    // size sweep mode
+    int sweep = 0;
+    unsigned long long sweep_min = 64, sweep_max = 16*1024*1024;
     
-    /* check command line arguments */
-    if (argc != 3) {
-        fprintf(stderr,"usage: %s <hostname> <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "e:p:N:CTc:t:s:w:Sz:O:")) != -1) {
+        switch (opt) {
+        case 'p':
+            synthetic_size = strtoull(optarg, NULL, 0);
+            break;
+        case 'N':
+            nstripes = atoi(optarg);
+            break;
+        case 'C':
+            check = 1;
+            break;
+        case 'S':
+            sweep = 1;
+            break;
+        case 'z':
+            if (sscanf(optarg, "%llu:%llu", &sweep_min, &sweep_max) != 2) {
+                fprintf(stderr, "bad size range %s, want min:max\n", optarg);
+                exit(0);
+            }
+            break;
+        case 'T':
+            throughput = 1;
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 't':
+            duration = atof(optarg);
+            break;
+        case 's':
+            limit = strtoull(optarg, NULL, 0);
+            break;
+        case 'w':
+            chunk = strtoul(optarg, NULL, 0);
+            break;
+        case 'O':
+            wait_mode = oc_wait_mode(optarg);
+            if (wait_mode < 0) {
+                fprintf(stderr, "bad wait mode %s, want futex, eventfd, inotify or poll\n", optarg);
+                exit(0);
+            }
+            break;
+        case 'e':
+            if (nest == EST_MAX) {
+                fprintf(stderr, "at most %d estimators\n", EST_MAX);
+                exit(0);
+            }
+            if (est_init(&est[nest], optarg) < 0) {
+                fprintf(stderr, "bad estimator spec %s\n", optarg);
+                exit(0);
+            }
+            nest++;
+            break;
+        default:
+            fprintf(stderr,"usage: %s [-e spec]... [-p bytes] [-N stripes] [-C] [-T [-c conns] [-t secs] [-s bytes] [-w bytes]] [-S [-z min:max]] [-O mode] <hostname> <port>\n", argv[0]);
+            exit(0);
+        }
+    }
+    if (nconns < 1 || nconns > MAX_CONNS || nstripes < 1 || nstripes > MAX_CONNS || chunk == 0) {
+        fprintf(stderr, "need 1 to %d connections or stripes and a non-zero write size\n", MAX_CONNS);
+        exit(0);
+    }
+    if (sweep_min == 0 || sweep_max < sweep_min) {
+        fprintf(stderr, "need 0 < min <= max for the size sweep\n");
         exit(0);
     }
-    hostname = argv[1];
-    portno = atoi(argv[2]);
+    if (nest == 0)
+        est_init(&est[nest++], "jk");
     
-    /* socket: create the socket */
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)
-        error("ERROR opening socket");
+    /* check command line arguments */
+    if (argc - optind != 2) {
+        fprintf(stderr,"usage: %s [-e spec]... [-p bytes] [-N stripes] [-C] [-T [-c conns] [-t secs] [-s bytes] [-w bytes]] [-S [-z min:max]] [-O mode] <hostname> <port>\n", argv[0]);
+        exit(0);
+    }
+    hostname = argv[optind];
+    portno = atoi(argv[optind + 1]);
     
     /* gethostbyname: get the server's DNS entry */
     server = gethostbyname(hostname);
@@ -117,72 +605,133 @@ int main(int argc, char **argv) {
           (char *)&serveraddr.sin_addr.s_addr, server->h_length);
     serveraddr.sin_port = htons(portno);
     
+    if (throughput) {
+        run_throughput(&serveraddr, nconns, duration, limit, chunk);
+        return 0;
+    }
+    
+    if (oc_reader_open(&offset_chan, "result.txt", wait_mode < 0 ? OC_WAIT_POLL : wait_mode) == -1)
+        error("ERROR opening result.txt");
+
     /* connect: create a connection with the server */
-    if (connect(sockfd, &serveraddr, sizeof(serveraddr)) < 0)
-        error("ERROR connecting");
+    sockfd = open_connection(&serveraddr);
+
+    if (check) {
+        crc32c_init();
+        printf("CRC32C: %s\n", crc32c_name);
+    }
+
+    if (sweep) {
+        run_sweep(sockfd, sweep_min, sweep_max, 600, check);
+        close(sockfd);
+        return 0;
+    }
+    
+    if (synthetic_size > 0)
+        payload_synthetic(&source, synthetic_size);
+    else
+        payload_from_file(&source, "send.png");
+    printf("Image size is: %llu\n", (unsigned long long)source.size);
+    
+    FILE *fp_latency = fopen("latency.txt", "a+");
+    FILE *fp_breakdown = fopen("breakdown.txt", "a+");
+    if (fp_latency == NULL || fp_breakdown == NULL)
+        error("ERROR opening log files");
+    
+    // stripe 0 rides on the main connection
+    stripe_fds[0] = sockfd;
+    for (k = 1; k < nstripes; k++)
+        stripe_fds[k] = open_connection(&serveraddr);
     
     int timer = 0;
     while(timer < 600) {
-        char* f_latency = "latency.txt";
-        FILE *fp_latency = fopen(f_latency, "a+");
-        char* f_name = "send.png";
-        int size;
-        FILE *fp = fopen(f_name, "rb");
-
-        if(fp == NULL){
-            error("ERROR open file");
-        }
-
-        fseek(fp, 0, SEEK_END);
-        size = ftell(fp);
-        fseek(fp, 0, SEEK_SET);
-        printf("Image size is: %d\n", size);
-        
-        n = write(sockfd, &size, sizeof(int));
-        if (n < 0)
-            error("ERROR writing to socket");
-
+        frame_header header = { FRAME_MAGIC, FRAME_LATENCY | (check ? FRAME_CRC : 0), source.size };
+        frame_reply reply;
         struct timeval tv_start;
-        gettimeofday(&tv_start, NULL);
-        printf("SENd Sec Usec: %ld， %d\n", tv_start.tv_sec, tv_start.tv_usec);
-        
-        bzero(buf, BUFSIZE);
-        int f_block_sz;
-        while((f_block_sz = fread(buf, sizeof(char), BUFSIZE, fp)) > 0){
-            /* send the message line to the server */
-            n = write(sockfd, buf, f_block_sz);
+        double t_send_header = now_seconds();
+
+        if (nstripes > 1) {
+            // every stripe header leaves together with its payload
+            gettimeofday(&tv_start, NULL);
+            printf("SENd Sec Usec: %ld， %ld\n", (long)tv_start.tv_sec, (long)tv_start.tv_usec);
+            send_striped(stripe_fds, nstripes, &source, ((uint64_t)getpid() << 32) | timer, check, &reply);
+        } else {
+            n = write(sockfd, &header, sizeof(header));
             if (n < 0)
                 error("ERROR writing to socket");
-            
-            /* print the server's reply */
-            bzero(buf, BUFSIZE);
+
+            gettimeofday(&tv_start, NULL);
+            printf("SENd Sec Usec: %ld， %ld\n", (long)tv_start.tv_sec, (long)tv_start.tv_usec);
+
+            /* send the payload to the server */
+            write_payload(sockfd, source.data, source.size, check);
+
+            read_reply(sockfd, &reply);
         }
-        
-        uint64_t t_finish;
-        n = read(sockfd, &t_finish, sizeof(uint64_t));
 
-        printf("t_finish: %llu\n", t_finish);
+        printf("t_finish: %llu\n", (unsigned long long)reply.t_finish);
         
         double offset = get_offset();
-        
-        double latency = t_finish/1000000.0 - ((double)tv_start.tv_sec + tv_start.tv_usec/1000000.0) - offset;
+        double t_start = (double)tv_start.tv_sec + tv_start.tv_usec/1000000.0;
+
+        /*
+         * Each server time-stamp is brought onto the local clock with the
+         * offset at its own instant, from the published history, rather
+         * than with whichever offset is newest once the reply is in.
+         */
+        double bound_start, bound_finish;
+        double offset_start = offset_at(t_start, &bound_start);
+        double offset_finish = server_offset(reply.t_finish/1000000.0, &bound_finish);
+        double latency = reply.t_finish/1000000.0 - t_start - offset_finish;
+        printf("offset at start %f (+-%f), at finish %f (+-%f), latest %f\n",
+               offset_start, bound_start, offset_finish, bound_finish, offset);
+
+        /*
+         * Breakdown: header one-way delay, first payload byte delay, time
+         * from first to last byte, server time blocked on disk and the
+         * CRC outcome (0 unchecked, 1 intact, 2 damaged)
+         */
+        double header_delay = reply.t_header/1000000.0 - server_offset(reply.t_header/1000000.0, NULL) - t_send_header;
+        double first_delay = reply.t_first/1000000.0 - server_offset(reply.t_first/1000000.0, NULL) - t_start;
+        double transfer = (reply.t_finish - reply.t_first)/1000000.0;
+        double disk = reply.disk_us/1000000.0;
+        fprintf(fp_breakdown, "%f %f %f %f %f %u\n", latency, header_delay, first_delay, transfer,
+                disk, reply.crc_status);
+        fflush(fp_breakdown);
+        printf("Breakdown: header %f, first byte %f, transfer %f, disk %f\n",
+               header_delay, first_delay, transfer, disk);
+        if (reply.crc_status == CRC_BAD) {
+            printf("CRC mismatch: server received %08x, sample %f not used\n", reply.crc, latency);
+            next_sample();
+            timer++;
+            continue;
+        }
        
-        if(timer == 0){
-        y_s = latency / 4.0;
-        y_var = latency / 4.0;
-        y_up = latency / 4.0;
-        } else {
-        estimiating(&y_s,  &y_var, &latency, &y_up);
+        /*
+         * Every estimator scores its standing prediction, then learns the
+         * sample. Logged per estimator: prediction and bound for the next
+         * sample, then the error of its prediction for this one.
+         */
+        fprintf(fp_latency, "%f", latency);
+        for (k = 0; k < nest; k++) {
+            est_sample(&est[k], latency);
+            fprintf(fp_latency, " %f %f %f", est[k].pred, est[k].up, est[k].last_err);
         }
+        fprintf(fp_latency, "\n");
+        fflush(fp_latency);
+        printf("Latency is %f, %s next %f, y_up is %f, error %f\n", latency,
+               est[0].spec, est[0].pred, est[0].up, est[0].last_err);
 
-        fprintf(fp_latency, "%f %f %f %f\n", latency, y_s, y_var, y_up);
-        printf("Latency is %f, y_s is %f, y_var is %f, y_up is %f\n", latency, y_s, y_var, y_up);
-
-        fclose(fp);
-        sleep(1);
+        next_sample();
         timer++;
     }
-    close(sockfd);
+    for (k = 0; k < nstripes; k++)
+        close(stripe_fds[k]);
+    fclose(fp_latency);
+    fclose(fp_breakdown);
+    payload_release(&source);
+    for (k = 0; k < nest; k++)
+        est_report(stdout, &est[k]);
     printf("Transmission finished!\n");
     return 0;
 }
@@ -1,6 +1,61 @@
 /*
  * udpclient.c - A simple UDP client
- * usage: udpclient <host> <port>
+ * usage: udpclient [-m m] [-n MIN] [-H] [-I] [-K] [-t ms] [-r retries] [-s port]
+ *                  [-M group:port [-c secs] [-i addr]] [-D rounds | -F kalman[:q_offset:q_skew]]
+ *                  [-R trace] [-f keep[:stages]] <host> <port>
+ *   -m  number of samples per round (prompted for if omitted)
+ *   -n  number of survivors kept by the clustering algorithm (prompted for if omitted)
+ *   -H  back the per-round arena with huge pages when the kernel has them
+ *   -I  interleaved mode: use the server's kernel transmit time-stamps,
+ *       which arrive one exchange late
+ *   -K  take the destination time-stamp from the kernel (SO_TIMESTAMPNS)
+ *       and report offset jitter against the user-space stamp each round
+ *   -t  milliseconds to wait for each reply before resending (default 500)
+ *   -r  resends of one probe before it counts as lost (default 2); a round
+ *       that loses m probes is abandoned, so every round ends within
+ *       2m(retries+1) timeouts
+ *   -s  relay: also serve time on this UDP port from the local clock
+ *       corrected by the latest offset, as a server one stratum below
+ *       ours, so other Pis can sync from this one instead of the laptop
+ *   -M  multicast client: join the group udpserver -M sends to and keep the
+ *       offset current from its broadcasts, running a unicast round only
+ *       every -c seconds (default 64) to calibrate the path delay; -i picks
+ *       the interface address the group is joined on
+ *   -D  fit the drift between the clocks over the last this many rounds
+ *       (at most 64) and publish the fitted offset with its skew, so
+ *       consumers extrapolate along it; the poll interval then doubles
+ *       while the fit's skew error keeps the extrapolation over the next
+ *       interval inside a round's bound, and halves when a round lands
+ *       more than three bounds from where the fit said it would
+ *   -F  replace combining with a Kalman filter over offset and skew that
+ *       takes every survivor of every round as a measurement (see
+ *       offset_kf in ntp.h for q_offset and q_skew); it publishes its
+ *       offset, skew and their standard deviations
+ *   -R  append every completed round to this trace: the local time, m,
+ *       then the m sample intervals, for sync_replay to compare
+ *       combining and filtering on offline
+ *   -f  clock filter: keep the last stages samples (default m, at most 64)
+ *       and pass only the keep narrowest, i.e. least queued, on to
+ *       selection; MIN <= keep <= m
+ *
+ * A broadcast only carries the server's transmit time, so on its own it
+ * gives the offset minus the one-way delay. After each unicast round the
+ * first CALIBRATE_BROADCASTS broadcasts are compared with the round's
+ * offset, and their mean difference is added to every broadcast until
+ * the next round. This absorbs any asymmetry between the multicast path
+ * and the unicast one, which matters on Wi-Fi where multicast is sent at
+ * the basic rate.
+ *
+ * A reply is only taken if it comes from the server and echoes the
+ * originate time-stamp of the request outstanding right now. Anything
+ * else is a late answer to an earlier send, or a second copy of one
+ * already used; both are dropped and counted.
+ *
+ * Each sample's correctness interval is widened by the server's root
+ * dispersion, so error bounds add up along a chain of relays. A relay
+ * advertises the half-width of its last selected interval, grown at
+ * NTP_PHI since the round that produced it, and refuses to look
+ * synchronised until its first round is in.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,124 +70,277 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "ntp.h"
+#include "offset_channel.h"
 
-/* Standard NTP packet, not necessary though */
-typedef struct{
-    //unsigned li   : 2;       // Only two bits. Leap indicator.
-    //unsigned vn   : 3;       // Only three bits. Version number of the protocol.
-    //unsigned mode : 3;       // Only three bits. Mode. Client will pick mode 3 for client.
-    
-    //uint8_t stratum;         // Eight bits. Stratum level of the local clock.
-    //uint8_t poll;            // Eight bits. Maximum interval between successive messages.
-    //uint8_t precision;       // Eight bits. Precision of the local clock.
-    
-    //uint32_t rootDelay;      // 32 bits. Total round trip delay time.
-    //uint32_t rootDispersion; // 32 bits. Max error aloud from primary clock source.
-    //uint32_t refId;          // 32 bits. Reference clock identifier.
-    
-    uint32_t refTm_s;        // 32 bits. Reference time-stamp seconds.
-    uint32_t refTm_f;        // 32 bits. Reference time-stamp fraction of a second.
-    
-    uint32_t origTm_s;       // 32 bits. Originate time-stamp seconds.
-    uint32_t origTm_f;       // 32 bits. Originate time-stamp fraction of a second.
-    
-    uint32_t rxTm_s;         // 32 bits. Received time-stamp seconds.
-    uint32_t rxTm_f;         // 32 bits. Received time-stamp fraction of a second.
-    
-    uint32_t txTm_s;         // 32 bits and the most important field the client cares about. Transmit time-stamp seconds.
-    uint32_t txTm_f;         // 32 bits. Transmit time-stamp fraction of a second.
-} ntp_packet;                // Total: 384 bits or 48 bytes.
+#define CALIBRATE_BROADCASTS 4 // broadcasts averaged into the delay after each round
+#define NTP_MODE_BROADCAST 5
 
-/* endpoint */
+/* What the relay serves from; written after every round, read per request */
 typedef struct{
-    unsigned type : 2; // 2 bits, 0 - lowpoint, 1 - midpoint, 2 - highpoint
-    double value; // The value of the end point;
-} ntp_point;
+    pthread_mutex_t lock;
+    int synced;               // 0 until the first round has combined
+    double offset;            // add to the local clock to get the server's time
+    uint8_t stratum;          // upstream stratum + 1
+    double root_delay;        // upstream root delay plus our shortest round trip, s
+    double root_dispersion;   // error bound when the offset was set, s
+    double ref_time;          // local clock time the offset was set
+    uint32_t ref_id;          // upstream IPv4 address, network order
+} relay_clock;
 
 typedef struct{
-    double l;
-    double u;
-    double deviation;
-} ntp_survivor;
-
-/* compare function for qsort in selection algorithm*/
-int compare_select(const void *p1, const void *p2) {
-    ntp_point *c1 = (ntp_point *) p1;
-    ntp_point *c2 = (ntp_point *) p2;
-    if(c1->value < c2->value)
-	return -1;
-    else if(c1->value > c2->value)
-	return 1;
-    else
-	return 0;
+    int sockfd;
+    relay_clock *clock;
+} relay_arg;
+
+/*
+ * error - wrapper for perror
+ */
+void error(char *msg) {
+    perror(msg);
+    exit(0);
 }
 
-/* compare function for qsort in clustering algorithm */
-int compare_cluster(const void *s1, const void *s2) {
-    ntp_survivor *c1 = (ntp_survivor *) s1;
-    ntp_survivor *c2 = (ntp_survivor *) s2;
-    if(c1->deviation < c2->deviation)
-        return -1;
-    else if(c1->deviation > c2->deviation)
-        return 1;
-    else
-        return 0;
+static double now_seconds(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + tv.tv_usec/1000000.0;
 }
 
-/* function used to get deviation of each target survivor */
-double find_deviation(ntp_survivor *s,int target, int len){
-    int i;
-    double sum = 0;
-    for(i = 0; i < len; i++){
-        sum += pow(((s[target].l+s[target].u)/2.0 - (s[i].l+s[i].u)/2.0), 2);
+/*
+ * relay_main - answer NTP requests on the relay socket from the local
+ * clock plus the latest offset, until the process exits
+ */
+static void *relay_main(void *p) {
+    relay_arg *arg = p;
+    relay_clock *clk = arg->clock;
+    ntp_packet packet;
+    struct sockaddr_in clientaddr;
+    socklen_t clientlen;
+    struct timeval tv, rx_stamp;
+    double t_rx, t_tx, offset, dispersion;
+    int n, stamped, synced;
+
+    while (1) {
+        memset(&packet, 0, sizeof(packet));
+        clientlen = sizeof(clientaddr);
+        n = recv_stamped(arg->sockfd, &packet, sizeof(packet), &clientaddr, &clientlen, &rx_stamp, &stamped);
+        if (n < 48)
+            continue;
+        if (!stamped)
+            gettimeofday(&rx_stamp, NULL);
+        t_rx = (double)rx_stamp.tv_sec + rx_stamp.tv_usec/1000000.0;
+
+        pthread_mutex_lock(&clk->lock);
+        synced = clk->synced;
+        offset = clk->offset;
+        dispersion = clk->root_dispersion + NTP_PHI * (t_rx - clk->ref_time);
+        packet.stratum = synced ? clk->stratum : NTP_STRATUM_MAX;
+        packet.rootDelay = ntp_short(clk->root_delay);
+        packet.refId = clk->ref_id;
+        packet.refTm_s = (uint32_t)floor(clk->ref_time + offset);
+        packet.refTm_f = (uint32_t)((clk->ref_time + offset - packet.refTm_s) * 1000000);
+        pthread_mutex_unlock(&clk->lock);
+
+        packet.li_vn_mode = ((synced ? 0 : NTP_LI_ALARM) << 6) | (NTP_VERSION << 3) | NTP_MODE_SERVER;
+        packet.rootDispersion = ntp_short(dispersion);
+        t_rx += offset;
+        packet.rxTm_s = (uint32_t)floor(t_rx);
+        packet.rxTm_f = (uint32_t)((t_rx - packet.rxTm_s) * 1000000);
+        gettimeofday(&tv, NULL);
+        t_tx = (double)tv.tv_sec + tv.tv_usec/1000000.0 + offset;
+        packet.txTm_s = (uint32_t)floor(t_tx);
+        packet.txTm_f = (uint32_t)((t_tx - packet.txTm_s) * 1000000);
+        packet.residence_ns = (uint32_t)((t_tx - t_rx) * 1e9);
+        sendto(arg->sockfd, &packet, sizeof(packet), 0, (struct sockaddr *)&clientaddr, clientlen);
     }
-    
-    return sqrt(sum/(len - 1));
+    return NULL;
 }
 
+/* send_probe - stamp packet with a fresh originate time and send it */
+static void send_probe(int sockfd, ntp_packet *packet, struct sockaddr_in *serveraddr) {
+    struct timeval tv;
 
-
-/*
- * error - wrapper for perror
- */
-void error(char *msg) {
-    perror(msg);
-    exit(0);
+    memset(packet, 0, sizeof(ntp_packet));
+    packet->li_vn_mode = (NTP_VERSION << 3) | NTP_MODE_CLIENT;
+    gettimeofday(&tv, NULL);
+    packet->origTm_s = (uint32_t)tv.tv_sec;
+    packet->origTm_f = (uint32_t)tv.tv_usec;
+    if (sendto(sockfd, (char *) packet, sizeof(ntp_packet), 0,
+               (struct sockaddr *) serveraddr, sizeof(*serveraddr)) < 0)
+        error("ERROR in sendto");
 }
 
 int main(int argc, char **argv) {
     int sockfd, portno, n;
-    int serverlen;
+    socklen_t fromlen;
+    struct sockaddr_in fromaddr;
     struct sockaddr_in serveraddr; //Server address data structure
     struct hostent *server; // Server data structure
     char *hostname;
     char temp[60];
-    int i, j;
+    int i;
     int flag;
-    // parameters for the selection algorithm
+    // number of samples per round and survivors kept by clustering
+    int m, MIN;
+    // interval picked by the selection algorithm
     double l, u;
-    int m, s, f, d, c;
-    // parameter for the clustering algorithm
-    int MIN, len, victim;
-    // parameters for the combining algorithm
-    double y,z;
     // final estimate
     double final_estimate;
-    // Output file
+    // per-round buffers, all carved from one arena
+    ntp_arena arena;
+    ntp_point *endpoints, *endpoint_scratch;
+    ntp_survivor *candidates, *survivors, *survivor_scratch;
+    int want_huge = 0;
+    int opt;
+    // seconds to sleep between rounds, doubled when the server sends a RATE kiss
+    int poll_interval = POLL_MIN;
+    // doublings owed to RATE kisses, undone one per KOD_RECOVER clean replies
+    int kod_backoff = 0, kod_clean = 0;
+    // interleaved mode: the previous exchange, completed by the next reply
+    int interleaved = 0, have_prev = 0;
+    uint32_t prev_org_s = 0, prev_org_f = 0;
+    double prev_t_org = 0, prev_t_rec = 0, prev_t_dst = 0, prev_t_dst_user = 0;
+    unsigned long interleave_miss = 0;
+    // kernel receive time-stamps, and the per-round jitter comparison against user-space ones
+    int kernel_stamps = 0, stamped;
+    struct timeval rx_stamp;
+    double kern_sum, kern_sumsq, user_sum, user_sumsq, wake_sum, jitter_ref = 0;
+    int stamp_count;
+    // server residence and wake-up reported in the replies of a round
+    double resid_sum, srv_wake_sum;
+    // per-probe deadline and retransmission
+    int timeout_ms = 500, retries = 2, tries, got, round_lost;
+    uint32_t sent_org_s, sent_org_f, used_org_s = 0, used_org_f = 0;
+    double deadline;
+    unsigned long retransmits = 0, lost = 0, stale = 0, duplicates = 0;
+    struct pollfd pfd;
+    // relay mode
+    int relay_port = 0;
+    relay_clock relay;
+    relay_arg relay_args;
+    pthread_t relay_thread;
+    int up_stratum = 0;
+    double up_root_delay = 0, min_rtt = 0;
+    // multicast mode
+    int mcast_fd = -1, group_port = 0, calib_secs = 64, calib_n = 0;
+    char group[64];
+    struct ip_mreq mreq;
+    double calib_offset = 0, calib_sum = 0, bcast_delay = 0, calib_bound = 0;
+    int calibrating = 0, have_delay = 0;
+    // drift fit across rounds
+    int drift_window = 0;
+    skew_fit fit;
+    // Kalman filter instead of combining, and the round trace
+    int use_kf = 0;
+    double q_offset = OKF_Q_OFFSET, q_skew = OKF_Q_SKEW;
+    offset_kf kf;
+    FILE *fp_trace = NULL;
+    // clock filter ahead of selection
+    int filter_keep = 0, filter_stages = 0;
+    clock_filter filter;
+    ntp_survivor picked[FILTER_STAGES_MAX];
+    unsigned long broadcasts = 0;
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    
+    m = 0;
+    MIN = 0;
+    while ((opt = getopt(argc, argv, "m:n:HIKt:r:s:M:c:i:D:F:R:f:")) != -1) {
+        switch (opt) {
+        case 'm':
+            m = atoi(optarg);
+            break;
+        case 'n':
+            MIN = atoi(optarg);
+            break;
+        case 'H':
+            want_huge = 1;
+            break;
+        case 'I':
+            interleaved = 1;
+            break;
+        case 'K':
+            kernel_stamps = 1;
+            break;
+        case 't':
+            timeout_ms = atoi(optarg);
+            break;
+        case 'r':
+            retries = atoi(optarg);
+            break;
+        case 's':
+            relay_port = atoi(optarg);
+            break;
+        case 'M':
+            if (sscanf(optarg, "%63[^:]:%d", group, &group_port) != 2 ||
+                inet_pton(AF_INET, group, &mreq.imr_multiaddr) != 1) {
+                fprintf(stderr, "bad multicast group %s, want group:port\n", optarg);
+                exit(0);
+            }
+            break;
+        case 'c':
+            calib_secs = atoi(optarg);
+            break;
+        case 'D':
+            drift_window = atoi(optarg);
+            break;
+        case 'F':
+            if (strncmp(optarg, "kalman", 6) != 0 ||
+                (optarg[6] != '\0' && sscanf(optarg + 6, ":%lf:%lf", &q_offset, &q_skew) != 2)) {
+                fprintf(stderr, "bad filter %s, want kalman[:q_offset:q_skew]\n", optarg);
+                exit(0);
+            }
+            use_kf = 1;
+            break;
+        case 'f':
+            if (sscanf(optarg, "%d:%d", &filter_keep, &filter_stages) < 1 || filter_keep < 1) {
+                fprintf(stderr, "bad clock filter %s, want keep[:stages]\n", optarg);
+                exit(0);
+            }
+            break;
+        case 'R':
+            fp_trace = fopen(optarg, "a");
+            if (fp_trace == NULL)
+                error("ERROR opening the trace");
+            break;
+        case 'i':
+            if (inet_pton(AF_INET, optarg, &mreq.imr_interface) != 1) {
+                fprintf(stderr, "bad interface address %s\n", optarg);
+                exit(0);
+            }
+            break;
+        default:
+            fprintf(stderr,"usage: %s [-m m] [-n MIN] [-H] [-I] [-K] [-t ms] [-r retries] [-s port] [-M group:port [-c secs] [-i addr]] [-D rounds | -F kalman[:q_offset:q_skew]] [-R trace] [-f keep[:stages]] <hostname> <port>\n", argv[0]);
+            exit(0);
+        }
+    }
     
     /* check command line arguments */
-    if (argc != 3) {
-        fprintf(stderr,"usage: %s <hostname> <port>\n", argv[0]);
+    if (argc - optind != 2 || timeout_ms < 1 || retries < 0 || calib_secs < 1 ||
+        drift_window < 0 || drift_window > SKEW_WINDOW_MAX || (use_kf && drift_window > 0)) {
+        fprintf(stderr,"usage: %s [-m m] [-n MIN] [-H] [-I] [-K] [-t ms] [-r retries] [-s port] [-M group:port [-c secs] [-i addr]] [-D rounds | -F kalman[:q_offset:q_skew]] [-R trace] [-f keep[:stages]] <hostname> <port>\n", argv[0]);
         exit(0);
     }
-    hostname = argv[1];
-    portno = atoi(argv[2]);
+    hostname = argv[optind];
+    portno = atoi(argv[optind + 1]);
     
     /* socket: create the socket */
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     
     if (sockfd < 0)
         error("ERROR opening socket");
+    if (kernel_stamps && enable_rx_timestamps(sockfd) < 0)
+        error("ERROR enabling receive time-stamps");
+    // replies are only read once poll says one is there
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
     
     /* gethostbyname: get the server's DNS entry */
     server = gethostbyname(hostname); // Convert URL to IP
@@ -152,50 +360,201 @@ int main(int argc, char **argv) {
     serveraddr.sin_port = htons(portno);
     
 
-    printf("please enter desired value of m:");
-    fgets(temp, 60, stdin);
-    m = atoi(temp);
+    if (m <= 0) {
+        printf("please enter desired value of m:");
+        fgets(temp, 60, stdin);
+        m = atoi(temp);
+    }
     printf("m is set to %d\n", m);
         
-    printf("please enter desired value of MIN(less than s):");
-    fgets(temp, 60, stdin);
-    MIN = atoi(temp);
+    if (MIN <= 0) {
+        printf("please enter desired value of MIN(less than s):");
+        fgets(temp, 60, stdin);
+        MIN = atoi(temp);
+    }
     printf("MIN is set to %d\n", MIN);
 
+    if (m <= 0 || MIN <= 0 || MIN > m || m > NTP_M_MAX) {
+        fprintf(stderr, "ERROR, need 0 < MIN <= m <= %d\n", NTP_M_MAX);
+        exit(0);
+    }
+    if (filter_keep > 0) {
+        if (filter_stages == 0)
+            filter_stages = m;
+        if (filter_keep < MIN || filter_keep > m || filter_stages < filter_keep || filter_stages > FILTER_STAGES_MAX) {
+            fprintf(stderr, "ERROR, need MIN <= keep <= m and keep <= stages <= %d\n", FILTER_STAGES_MAX);
+            exit(0);
+        }
+        filter_init(&filter, filter_stages);
+        printf("clock filter: %d narrowest of the last %d samples\n", filter_keep, filter_stages);
+    }
+
+    skew_init(&fit, drift_window);
+    okf_init(&kf, q_offset, q_skew);
+
     /* Set up an array of endpoints to store lowpoint, midpoint and highpoint*/
-    ntp_point endpoints[3*m];
-    ntp_survivor candidates[m];
-    ntp_survivor survivors[m];
+    arena_init(&arena, arena_bytes(m), want_huge);
+    endpoints = arena_alloc(&arena, 3*m*sizeof(ntp_point));
+    endpoint_scratch = arena_alloc(&arena, 3*m*sizeof(ntp_point));
+    candidates = arena_alloc(&arena, m*sizeof(ntp_survivor));
+    survivors = arena_alloc(&arena, m*sizeof(ntp_survivor));
+    survivor_scratch = arena_alloc(&arena, m*sizeof(ntp_survivor));
+    printf("memory: arena %zu bytes mapped, %zu used, %s pages\n",
+           arena.size, arena.used, arena.huge ? "huge" : "normal");
     /* Initializing the NTP packet */
-    ntp_packet packet = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    ntp_packet packet = { 0 };
 
-    // Open the file
+    // result.txt carries the offset and a generation for tcpclient to wait on
+    oc_writer chan;
+    if (oc_writer_open(&chan, "result.txt") == -1)
+    {
+        perror("Error opening result.txt");
+        exit(EXIT_FAILURE);
+    }
     
+    if (relay_port > 0) {
+        memset(&relay, 0, sizeof(relay));
+        pthread_mutex_init(&relay.lock, NULL);
+        relay.ref_id = serveraddr.sin_addr.s_addr;
+        relay_args.clock = &relay;
+        relay_args.sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (relay_args.sockfd < 0)
+            error("ERROR opening relay socket");
+        if (kernel_stamps && enable_rx_timestamps(relay_args.sockfd) < 0)
+            error("ERROR enabling receive time-stamps");
+        struct sockaddr_in relayaddr;
+        bzero((char *) &relayaddr, sizeof(relayaddr));
+        relayaddr.sin_family = AF_INET;
+        relayaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+        relayaddr.sin_port = htons((unsigned short)relay_port);
+        if (bind(relay_args.sockfd, (struct sockaddr *) &relayaddr, sizeof(relayaddr)) < 0)
+            error("ERROR on binding relay port");
+        if (pthread_create(&relay_thread, NULL, relay_main, &relay_args) != 0)
+            error("ERROR creating relay thread");
+        printf("relay: serving on port %d\n", relay_port);
+    }
+
+    if (group_port > 0) {
+        struct sockaddr_in groupaddr;
+        int one = 1;
+        mcast_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (mcast_fd < 0)
+            error("ERROR opening multicast socket");
+        // several clients on one host may listen to the same group
+        setsockopt(mcast_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (kernel_stamps && enable_rx_timestamps(mcast_fd) < 0)
+            error("ERROR enabling receive time-stamps");
+        bzero((char *) &groupaddr, sizeof(groupaddr));
+        groupaddr.sin_family = AF_INET;
+        groupaddr.sin_addr = mreq.imr_multiaddr;
+        groupaddr.sin_port = htons((unsigned short)group_port);
+        if (bind(mcast_fd, (struct sockaddr *) &groupaddr, sizeof(groupaddr)) < 0)
+            error("ERROR on binding the multicast port");
+        if (setsockopt(mcast_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+            error("ERROR joining the multicast group");
+        printf("multicast: listening on %s:%d, calibrating every %d s\n", group, group_port, calib_secs);
+    }
+
     while(1){
     i = 0;
     flag = 1;
+    kern_sum = kern_sumsq = user_sum = user_sumsq = wake_sum = 0;
+    stamp_count = 0;
+    resid_sum = srv_wake_sum = 0;
+    round_lost = 0;
+    min_rtt = 0;
     while(i < m){
-        memset( &packet, 0, sizeof( ntp_packet ) );
-        
         struct timeval tv;
-        gettimeofday(&tv, NULL);
-        packet.origTm_s = (uint32_t)tv.tv_sec;
-        packet.origTm_f = (uint32_t)tv.tv_usec;
-        
 
-        /* send the message to the server */
-        serverlen = sizeof(serveraddr);
-        n = sendto(sockfd, (char *) &packet, sizeof(packet), 0, &serveraddr, serverlen);
-        if (n < 0)
-            error("ERROR in sendto");
-        /* print the server's reply */
-        n = recvfrom(sockfd, (char *) &packet, sizeof(packet), 0, &serveraddr, &serverlen);
-        if (n < 0)
-            error("ERROR in recvfrom");
+        /* send the message to the server, resending until a matching reply or the retry budget runs out */
+        send_probe(sockfd, &packet, &serveraddr);
+        sent_org_s = packet.origTm_s;
+        sent_org_f = packet.origTm_f;
+        deadline = now_seconds() + timeout_ms/1000.0;
+        tries = 0;
+        got = 0;
+        while (!got) {
+            double left = deadline - now_seconds();
+            if (left <= 0) {
+                if (tries == retries)
+                    break;
+                tries++;
+                retransmits++;
+                send_probe(sockfd, &packet, &serveraddr);
+                sent_org_s = packet.origTm_s;
+                sent_org_f = packet.origTm_f;
+                deadline = now_seconds() + timeout_ms/1000.0;
+                continue;
+            }
+            if (poll(&pfd, 1, (int)(left*1000) + 1) <= 0)
+                continue;
+            fromlen = sizeof(fromaddr);
+            n = recv_stamped(sockfd, (char *) &packet, sizeof(packet), &fromaddr, &fromlen, &rx_stamp, &stamped);
+            if (n < 0) {
+                // ICMP errors for earlier sends surface here; the deadline covers them
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED)
+                    continue;
+                error("ERROR in recvfrom");
+            }
+            if (n < 48 || fromaddr.sin_addr.s_addr != serveraddr.sin_addr.s_addr ||
+                fromaddr.sin_port != serveraddr.sin_port) {
+                stale++;
+                continue;
+            }
+            if (packet.origTm_s != sent_org_s || packet.origTm_f != sent_org_f) {
+                if (packet.origTm_s == used_org_s && packet.origTm_f == used_org_f)
+                    duplicates++;
+                else
+                    stale++;
+                continue;
+            }
+            got = 1;
+        }
+        if (!got) {
+            lost++;
+            if (++round_lost == m) {
+                printf("lost %d probes this round, abandoning it\n", round_lost);
+                flag = 0;
+                break;
+            }
+            continue;
+        }
+        used_org_s = sent_org_s;
+        used_org_f = sent_org_f;
+
+        /* Kiss-o'-Death: the server is rate limiting us, so drop the round and back off */
+        if (packet.stratum == 0 && ntohl(packet.refId) == KOD_RATE) {
+            if (poll_interval < POLL_MAX) {
+                poll_interval *= 2;
+                kod_backoff++;
+            }
+            kod_clean = 0;
+            printf("server sent RATE kiss, poll interval now %d s\n", poll_interval);
+            flag = 0;
+            break;
+        }
+        if (kod_backoff > 0 && ++kod_clean == KOD_RECOVER) {
+            poll_interval = poll_interval/2 > POLL_MIN ? poll_interval/2 : POLL_MIN;
+            kod_backoff--;
+            kod_clean = 0;
+            printf("no RATE kiss for %d replies, poll interval back to %d s\n", KOD_RECOVER, poll_interval);
+        }
+
+        /* a server that has no time to give: a relay before its first round, or any other kiss */
+        if (ntp_unsynchronised(&packet)) {
+            printf("server is not synchronised (stratum %u), skipping the round\n", packet.stratum);
+            flag = 0;
+            break;
+        }
+        up_stratum = packet.stratum;
+        up_root_delay = ntp_short_seconds(packet.rootDelay);
 	
         //printf("Echo from server: %u, %u, %u,\n %u, %u, %u\n", packet.origTm_s,packet.origTm_f, packet.rxTm_s, packet.rxTm_f, packet.txTm_s, packet.txTm_f);
         
         gettimeofday(&tv, NULL);
+        double t_dst_user = (double)tv.tv_sec + tv.tv_usec/1000000.0;
+        if (stamped)
+            tv = rx_stamp;
         packet.refTm_s = (uint32_t)tv.tv_sec;
         packet.refTm_f = (uint32_t)tv.tv_usec;
         //printf("T_dst is: %u, %u\n", packet.refTm_s, packet.refTm_f);
@@ -205,16 +564,66 @@ int main(int argc, char **argv) {
         double t_xmt = (double)packet.txTm_s + packet.txTm_f/1000000.0;
         double t_dst = (double)packet.refTm_s + packet.refTm_f/1000000.0;
 
+        if (interleaved) {
+            /*
+             * Interleaved mode: the reply carries the server's actual
+             * transmit time of its previous reply to us, so this sample
+             * completes the previous exchange and the current one is
+             * kept until the next reply. A server that sends no
+             * transmit time-stamps gets the basic sample instead.
+             */
+            int has_prev_tx = packet.prevTxTm_s != 0 || packet.prevTxTm_f != 0;
+            int match = has_prev_tx && have_prev && packet.prevOrigTm_s == prev_org_s && packet.prevOrigTm_f == prev_org_f;
+            double cur_org = t_org, cur_rec = t_rec, cur_dst = t_dst, cur_dst_user = t_dst_user;
+            if (match) {
+                t_org = prev_t_org;
+                t_rec = prev_t_rec;
+                t_dst = prev_t_dst;
+                t_dst_user = prev_t_dst_user;
+                t_xmt = (double)packet.prevTxTm_s + packet.prevTxTm_f/1000000.0;
+            }
+            prev_org_s = packet.origTm_s;
+            prev_org_f = packet.origTm_f;
+            prev_t_org = cur_org;
+            prev_t_rec = cur_rec;
+            prev_t_dst = cur_dst;
+            prev_t_dst_user = cur_dst_user;
+            have_prev = 1;
+            if (has_prev_tx && !match) {
+                interleave_miss++;
+                continue;
+            }
+        }
+
         //printf("t_org: %f, t_rec: %f, t_xmt: %f, t_dst: %f\n", t_org, t_rec, t_xmt, t_dst);
 
+        resid_sum += packet.residence_ns;
+        srv_wake_sum += packet.wake_ns;
+
         double RTT = (t_dst - t_org) - (t_xmt - t_rec);
         double offset = ((t_rec - t_org) + (t_xmt - t_dst))/2;
-        double lowbound = offset - RTT/2;
-        double highbound = offset + RTT/2;
+        double lowbound, highbound;
+        ntp_sample_bounds(&packet, offset, RTT, &lowbound, &highbound);
+        if (min_rtt == 0 || RTT < min_rtt)
+            min_rtt = RTT;
+        if (stamped) {
+            // sums are kept relative to the round's first offset to avoid cancellation
+            double offset_user = ((t_rec - t_org) + (t_xmt - t_dst_user))/2;
+            if (stamp_count == 0)
+                jitter_ref = offset;
+            kern_sum += offset - jitter_ref;
+            kern_sumsq += (offset - jitter_ref)*(offset - jitter_ref);
+            user_sum += offset_user - jitter_ref;
+            user_sumsq += (offset_user - jitter_ref)*(offset_user - jitter_ref);
+            wake_sum += t_dst_user - t_dst;
+            stamp_count++;
+        }
         //printf("RTT: %f s, Offset: %f s\n", RTT, offset);
         //printf("Bound of estimate: [%f, %f]\n", lowbound, highbound);
         candidates[i].l = lowbound;
         candidates[i].u = highbound;
+        if (filter_keep > 0)
+            filter_add(&filter, t_dst, lowbound, highbound);
         endpoints[i].type = 0;
         endpoints[i].value = lowbound;
         endpoints[i+m].type = 1;
@@ -224,173 +633,158 @@ int main(int argc, char **argv) {
         i++;
     }
     
-    /* 
-     * Start of selection algorithm
-     */
-    // Sort the endpoints
-    qsort(endpoints, 3*m, sizeof(ntp_point), compare_select);
-    
-    //for(i = 0; i < 3*m; i++){
-    //    printf("type: %u, value: %f\n", endpoints[i].type, endpoints[i].value);
-    //}
-    
-    f = 0; // set the number of flasetickers to zero
-    l = 0;
-    u = 0;
-    while(1){
-        d = 0;
-        c = 0;
-        for(i = 0; i < 3*m; i++){
-            if(endpoints[i].type == 0)
-                c++;
-            else if(endpoints[i].type == 2)
-                c--;
-            else
-                d++;
-            
-            if(c >= (m - f)){
-                l = endpoints[i].value;
-                break;
-            }
-        }
-        
-	c = 0;
-        for(i = 0; i < 3*m; i++){
-            if(endpoints[3*m - 1 - i].type == 2)
-                c++;
-            else if(endpoints[3*m - 1 - i].type == 0)
-                c--;
-            else
-                d++;
-            
-            if(c >= (m - f)){
-                u = endpoints[3*m - 1 - i].value;
-                break;
-            }
-        }
-        
-        if(d <= f && l < u){
-            //fprintf(fp, "[%f, %f]\n", l , u);
-	    printf("[%f, %f]\n", l , u);
-            break;
-        } else{
-            f++;
-            if(f >= m/2){
-                //printf("Failure;a majority clique could not be found..\n");
-                flag = 0;
-		break;
-            }
-        }
+    if (interleaved)
+        printf("interleaved: %lu replies without a usable previous transmit time\n", interleave_miss);
+    printf("probes: %lu retransmitted, %lu lost, %lu stale and %lu duplicate replies dropped\n",
+           retransmits, lost, stale, duplicates);
+    if (i > 0)
+        printf("server: mean residence %.1f us, mean wake-up %.1f us over %d replies\n",
+               resid_sum/i/1000, srv_wake_sum/i/1000, i);
+    if (stamp_count > 1) {
+        double kern_mean = kern_sum/stamp_count, user_mean = user_sum/stamp_count;
+        printf("rx stamps: offset jitter kernel %.1f us, user %.1f us, mean wake-up %.1f us over %d samples\n",
+               1e6*sqrt(fmax(kern_sumsq/stamp_count - kern_mean*kern_mean, 0)),
+               1e6*sqrt(fmax(user_sumsq/stamp_count - user_mean*user_mean, 0)),
+               1e6*wake_sum/stamp_count, stamp_count);
     }
-    
-    if(flag){
-    len = 0;
-        
-    for(i = 0; i < m; i++){
-        if((candidates[i].l + candidates[i].u >= 2*l) && (candidates[i].l + candidates[i].u) <= 2*u){
-            survivors[len].l = candidates[i].l;
-            survivors[len].u = candidates[i].u;
-            len++;
-        }
-	survivors[i].deviation = 0;
+
+    double t_round = now_seconds();
+    int combined = 0;
+    if (flag && fp_trace != NULL) {
+        fprintf(fp_trace, "%f %d", t_round, m);
+        for (i = 0; i < m; i++)
+            fprintf(fp_trace, " %.9f %.9f", candidates[i].l, candidates[i].u);
+        fprintf(fp_trace, "\n");
+        fflush(fp_trace);
     }
-    
-    
-    //for(i = 0; i < s; i ++){
-    //   printf("survivor %d: l %f, u %f\n", i, survivors[i].l, survivors[i].u);
-    //}
-    /* End of selection algorithm */
-    
-    /*
-     * Start of clustering algorithm
-     */
-    victim = 0;
-    while(len > MIN){
-        for(i = 0; i < len; i++){
-            survivors[i].deviation = find_deviation(survivors, i, len);
-            //printf("deviation for survivor %d is %f\n", i, survivors[i].deviation);
-        }
-        qsort(survivors, len, sizeof(ntp_survivor), compare_cluster);
-        //for(i = 0; i < len; i++){
-            //printf("deviation for survivor %d is %f\n", i, survivors[i].deviation);
-        //}
-	len--;
+    // what goes on to selection: the whole round, or what the clock filter lets through
+    int nsel = m;
+    ntp_survivor *sel = candidates;
+    if (flag && filter_keep > 0) {
+        nsel = filter_pick(&filter, filter_keep, t_round, use_kf ? kf.skew : fit.skew, use_kf, picked);
+        sel = picked;
+        ntp_endpoints(endpoints, sel, nsel);
     }
-    
-    //printf("The list after clustering algorithm is\n");
-    //for(i = 0; i < len; i++){
-    //    printf("%d, l %f, u %f\n", i, survivors[i].l, survivors[i].u);
-    //}
-    /* End of clustering algorithm */
-    
-    /* 
-     * Start of combining algorithm
-     */
-    y = 0;
-    z = 0;
-    
-    for(i = 0; i < MIN; i++){
-        y += 2/(survivors[i].u - survivors[i].l);
-        z += (survivors[i].u + survivors[i].l)/(survivors[i].u - survivors[i].l);
+    if (flag && use_kf) {
+        int len = ntp_select(nsel, MIN, endpoints, endpoint_scratch, sel, survivors,
+                             survivor_scratch, &l, &u);
+        if (len >= 0) {
+            okf_round(&kf, t_round, survivors, len);
+            final_estimate = kf.offset;
+            combined = 1;
+        }
+    } else if (flag) {
+        combined = ntp_combine(nsel, MIN, endpoints, endpoint_scratch, sel, survivors,
+                               survivor_scratch, &final_estimate, &l, &u) == 0;
     }
-    
-    final_estimate = z/y;
-    /* End of combining algorithm */
 
-    const char *filepath = "result.txt";
-    int fd = open(filepath, O_RDWR | O_CREAT, (mode_t)0600); // | O_TRUNC
-    
-    if (fd == -1)
-    {
-        perror("Error opening file for writing");
-        exit(EXIT_FAILURE);
-    }
-    
-    size_t datasize = sizeof(double) + 1;
+    if(combined){
+    printf("[%f, %f]\n", l , u);
 
-    if (lseek(fd, datasize-1, SEEK_SET) == -1)
-    {
-        close(fd);
-        perror("Error calling lseek() to 'stretch' the file");
-        exit(EXIT_FAILURE);
+    double pub_bound = (u - l)/2, pub_skew = fit.skew, pub_skew_err = fit.skew_err;
+    if (use_kf) {
+        pub_bound = sqrt(kf.P[0][0]);
+        pub_skew = kf.skew;
+        pub_skew_err = sqrt(kf.P[1][1]);
+        printf("kalman: offset %f +- %f, skew %.3f ppm +- %.3f\n", kf.offset, pub_bound,
+               kf.skew*1e6, pub_skew_err*1e6);
     }
-
-    if (write(fd, "", 1) == -1)
-    {
-        close(fd);
-        perror("Error writing last byte of the file");
-        exit(EXIT_FAILURE);
+    if (drift_window > 0) {
+        /* poll less often while the fit predicts the rounds, more often once it stops */
+        if (fit.count >= 2) {
+            double miss = fabs(final_estimate - skew_predict(&fit, t_round));
+            if (miss > 3*(u - l)/2 && poll_interval > POLL_MIN) {
+                poll_interval = poll_interval/2 > POLL_MIN ? poll_interval/2 : POLL_MIN;
+                printf("drift: round missed the fit by %f, poll interval now %d s\n", miss, poll_interval);
+            } else if (fit.count >= fit.window && poll_interval < POLL_MAX &&
+                       fit.skew_err * 2*poll_interval < (u - l)/2) {
+                poll_interval = 2*poll_interval < POLL_MAX ? 2*poll_interval : POLL_MAX;
+                printf("drift: poll interval now %d s\n", poll_interval);
+            }
+        }
+        skew_add(&fit, t_round, final_estimate, (u - l)/2);
+        final_estimate = fit.offset;
+        printf("drift: offset %f, skew %.3f ppm +- %.3f over %d rounds\n", fit.offset,
+               fit.skew*1e6, fit.skew_err*1e6, fit.count < fit.window ? fit.count : fit.window);
+        pub_skew = fit.skew;
+        pub_skew_err = fit.skew_err;
     }
-    
-    
-    // Now the file is ready to be mmapped.
-    double *map = mmap(0, sizeof(double), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (map == MAP_FAILED)
-    {
-        close(fd);
-        perror("Error mmapping the file");
-        exit(EXIT_FAILURE);
+    oc_publish(&chan, t_round, final_estimate, pub_bound, pub_skew, pub_skew_err);
+    if (relay_port > 0) {
+        pthread_mutex_lock(&relay.lock);
+        relay.offset = final_estimate;
+        relay.stratum = up_stratum + 1;
+        relay.root_delay = up_root_delay + fmax(min_rtt, 0);
+        relay.root_dispersion = (u - l)/2;
+        relay.ref_time = now_seconds();
+        relay.synced = 1;
+        pthread_mutex_unlock(&relay.lock);
+        printf("relay: stratum %d, root delay %f, root dispersion %f\n",
+               relay.stratum, relay.root_delay, relay.root_dispersion);
     }
 
-    map[0] = final_estimate;
-
     // Write it now to disk
-    if (msync(map, datasize, MS_SYNC) == -1)
+    if (msync(chan.page, sizeof(oc_page), MS_SYNC) == -1)
     {
         perror("Could not sync the file to disk");
     }
-    
-    // Don't forget to free the mmapped memory
-    if (munmap(map, datasize) == -1)
-    {
-        close(fd);
-        perror("Error un-mmapping the file");
-        exit(EXIT_FAILURE);
+    // the broadcasts that follow are calibrated against this offset
+    calib_offset = final_estimate;
+    calib_bound = (u - l)/2;
+    calib_sum = 0;
+    calib_n = 0;
+    calibrating = 1;
+    }
+    if (mcast_fd < 0) {
+        sleep(poll_interval);
+        continue;
     }
 
-    close(fd);
+    /* multicast: follow the broadcasts until the next calibration round is due */
+    double calib_end = now_seconds() + (calib_secs > poll_interval ? calib_secs : poll_interval);
+    struct pollfd mfd = { .fd = mcast_fd, .events = POLLIN };
+    double left;
+    while ((left = calib_end - now_seconds()) > 0) {
+        struct timeval tv;
+        if (poll(&mfd, 1, (int)(left*1000) + 1) <= 0)
+            continue;
+        fromlen = sizeof(fromaddr);
+        n = recv_stamped(mcast_fd, (char *) &packet, sizeof(packet), &fromaddr, &fromlen, &rx_stamp, &stamped);
+        if (n < 48 || fromaddr.sin_addr.s_addr != serveraddr.sin_addr.s_addr ||
+            (packet.li_vn_mode & 7) != NTP_MODE_BROADCAST)
+            continue;
+        if (stamped)
+            tv = rx_stamp;
+        else
+            gettimeofday(&tv, NULL);
+        double t_xmt = (double)packet.txTm_s + packet.txTm_f/1000000.0;
+        double t_dst = (double)tv.tv_sec + tv.tv_usec/1000000.0;
+        double raw = t_xmt - t_dst; // offset less the one-way delay
+        broadcasts++;
+
+        if (calibrating) {
+            calib_sum += calib_offset - raw;
+            if (++calib_n == CALIBRATE_BROADCASTS) {
+                calibrating = 0;
+                bcast_delay = calib_sum / CALIBRATE_BROADCASTS;
+                have_delay = 1;
+                printf("multicast: delay calibrated to %f s\n", bcast_delay);
+            }
+            continue;
+        }
+        if (!have_delay)
+            continue;
+        final_estimate = raw + bcast_delay;
+        // a broadcast is as good as the round that calibrated it
+        oc_publish(&chan, t_dst, final_estimate, calib_bound, use_kf ? kf.skew : fit.skew,
+                   use_kf ? sqrt(kf.P[1][1]) : fit.skew_err);
+        if (relay_port > 0) {
+            pthread_mutex_lock(&relay.lock);
+            relay.offset = final_estimate;
+            pthread_mutex_unlock(&relay.lock);
+        }
+        printf("multicast: offset %f (%lu broadcasts)\n", final_estimate, broadcasts);
     }
-    sleep(5);
     }
     
     return 0;
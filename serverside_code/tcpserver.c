@@ -1,6 +1,33 @@
 /*
  * tcpserver.c - A simple TCP echo server
- * usage: tcpserver <port>
+ * usage: tcpserver [-i interval] [-W] <port>
+ *   -i  seconds between throughput reports on streaming connections (default 1)
+ *   -W  receive latency payloads into pooled buffers and leave the file
+ *       writes to a writer thread per connection, instead of reading
+ *       straight into a mapping of the output file
+ *
+ * Every connection is served by its own thread. A connection carries a
+ * sequence of frames, each a frame_header followed by its payload:
+ *   FRAME_LATENCY  payload of header.size bytes, received straight into
+ *                  a mapping of received/<conn>-<n>.png, of which each
+ *                  connection keeps its last RECEIVE_KEEP, and answered with
+ *                  a frame_reply giving when the header, the first and
+ *                  the last payload byte arrived and the time spent
+ *                  handing the file back to the kernel (with -W, how
+ *                  long the writer lagged behind the last byte)
+ *   FRAME_STREAM   payload runs until the client closes; bytes received
+ *                  per interval are reported with timestamps
+ *   FRAME_STRIPE   a stripe_header, then header.size bytes of one piece
+ *                  of a payload split across several connections. Each
+ *                  piece lands at its offset in received/<host>-<id>.png
+ *                  and every connection of the transfer is answered once
+ *                  the last piece is in, with the earliest header and
+ *                  first byte and the latest last byte over all stripes
+ *
+ * A FRAME_LATENCY or FRAME_STRIPE type may carry FRAME_CRC, in which case
+ * its payload is followed by a 4-byte CRC32C trailer (crc32c.h). The
+ * server checks it as the bytes arrive and reports the outcome in the
+ * reply.
  */
 
 #include <stdio.h>
@@ -13,8 +40,140 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include "crc32c.h"
 
-#define BUFSIZE 1024*4
+#define STREAM_BUFSIZE 1024*64
+
+#define FRAME_MAGIC 0x46524d31 // "FRM1"
+#define FRAME_LATENCY 1
+#define FRAME_STREAM 2
+#define FRAME_STRIPE 3
+#define FRAME_CRC 0x100  // flag on the type: a CRC32C of the payload follows it
+
+#define CRC_NONE 0       // frame_reply.crc_status: no trailer was sent
+#define CRC_OK 1
+#define CRC_BAD 2
+
+/* Frame header sent ahead of every payload */
+typedef struct{
+    uint32_t magic;  // FRAME_MAGIC
+    uint32_t type;   // FRAME_LATENCY, FRAME_STREAM or FRAME_STRIPE, optionally with FRAME_CRC set
+    uint64_t size;   // payload (or stripe) bytes that follow, unused for FRAME_STREAM
+} frame_header;
+
+/* Reply to a FRAME_LATENCY transfer; times are server wall clock in microseconds */
+typedef struct{
+    uint64_t t_finish;   // last payload byte arrived
+    uint64_t t_header;   // frame header arrived
+    uint64_t t_first;    // first payload byte arrived
+    uint64_t disk_us;    // time spent blocked writing the payload to disk, or the writer's backlog with -W
+    uint32_t crc;        // CRC32C of the payload as received, if checked
+    uint32_t crc_status; // CRC_NONE, CRC_OK or CRC_BAD
+} frame_reply;
+
+/* Follows a FRAME_STRIPE header: which piece of which transfer this is */
+typedef struct{
+    uint64_t transfer;  // id shared by every stripe of one payload
+    uint64_t offset;    // where this stripe lands in the payload
+    uint64_t total;     // size of the whole payload
+    uint32_t count;     // stripes the payload was split into
+    uint32_t pad;
+} stripe_header;
+
+#define RECEIVE_DIR "received"
+#define RECEIVE_KEEP 16 // latency payloads kept on disk per connection, older ones are removed
+#define MAX_PAYLOAD (1ULL << 30) // largest payload accepted, bytes
+
+#define MAX_TRANSFERS 64
+#define STRIPE_TIMEOUT 30 // seconds a stripe waits for the rest of its transfer
+
+/*
+ * A striped transfer being reassembled; slots are guarded by transfers_lock.
+ * A failed transfer's slot stays behind as a tombstone until its
+ * stripes have timed out, so a late one is turned away rather than
+ * starting the transfer afresh over the partly received file.
+ */
+typedef struct{
+    uint64_t transfer;      // client's transfer id
+    char hostaddr[INET_ADDRSTRLEN];
+    int used;
+    time_t expires;         // tombstone: when the slot may be reused, 0 while the transfer is live
+    int fd;
+    char *map;
+    uint64_t total;
+    uint32_t count;         // stripes expected
+    uint32_t landed;        // stripes finished, successfully or not
+    uint32_t attached;      // stripe threads still holding the slot
+    int failed;
+    frame_reply reply;      // merged over the stripes landed so far
+    pthread_cond_t done;    // signalled when the last stripe lands
+} striped_transfer;
+
+static striped_transfer transfers[MAX_TRANSFERS];
+static pthread_mutex_t transfers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define POOL_BUFFERS 16           // receive buffers per connection with -W
+#define POOL_BUFSIZE (256*1024)
+#define RING_SLOTS 32             // power of two, room for every buffer plus end marks
+#define WRITE_END -1              // write_job.buf: transfer complete, close its file
+#define WRITE_STOP -2             // write_job.buf: connection closing, writer exits
+
+/* A filled pool buffer on its way to the disk writer, or a control mark */
+typedef struct{
+    int fd;
+    int buf;           // pool index, WRITE_END or WRITE_STOP
+    uint32_t len;
+    uint64_t offset;   // file offset of the buffer's first byte
+} write_job;
+
+/* Single-producer single-consumer ring; head and tail only ever grow */
+typedef struct{
+    write_job slots[RING_SLOTS];
+    _Atomic unsigned head;  // advanced by the consumer
+    _Atomic unsigned tail;  // advanced by the producer
+} spsc_ring;
+
+/*
+ * Per-connection disk writer: the receive thread fills pool buffers and
+ * pushes them on filled, the writer pwrite()s them and returns them on
+ * free. Neither side takes a lock to pass buffers; the mutex only parks
+ * an idle writer, or a receive thread waiting for a free buffer or for
+ * the writer to close a transfer.
+ */
+typedef struct{
+    spsc_ring filled;           // receive thread -> writer
+    spsc_ring free;             // writer -> receive thread
+    char *pool;                 // POOL_BUFFERS * POOL_BUFSIZE bytes
+    _Atomic unsigned finished;  // transfers fully written and closed
+    _Atomic uint64_t drained;   // when the last of them was closed, us
+    _Atomic int parked;
+    _Atomic int waiting;        // the receive thread sleeps on progress
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        // writer: filled has a job
+    pthread_cond_t progress;    // receive thread: a buffer came back or a transfer closed
+    pthread_t thread;
+} disk_writer;
+
+typedef struct{
+    int childfd;
+    int id;
+    unsigned transfers; // latency transfers received so far
+    char hostaddr[INET_ADDRSTRLEN];
+    disk_writer *writer; // NULL unless -W
+} connection;
+
+static double report_interval = 1.0;
+static int async_disk = 0;
 
 /*
  * error - wrapper for perror
@@ -24,34 +183,720 @@ void error(char *msg) {
     exit(1);
 }
 
+/* read_full - read exactly len bytes; 0 on a clean EOF before any byte, -1 on error */
+static int read_full(int fd, void *buf, size_t len) {
+    size_t got = 0;
+    int n;
+
+    while (got < len) {
+        n = read(fd, (char *)buf + got, len - got);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            return got == 0 ? 0 : -1;
+        got += n;
+    }
+    return 1;
+}
+
+static uint64_t now_us(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static double now_seconds(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+/*
+ * allocate_file - give fd size bytes of real blocks up front, so the
+ * mapping never has to extend the file while the payload lands
+ */
+static int allocate_file(int fd, uint64_t size) {
+#ifdef __linux__
+    int err = posix_fallocate(fd, 0, size);
+    if (err == 0)
+        return 0;
+    if (err != EOPNOTSUPP && err != EINVAL) {
+        errno = err;
+        return -1;
+    }
+#elif defined(F_PREALLOCATE)
+    fstore_t store = { F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)size, 0 };
+    fcntl(fd, F_PREALLOCATE, &store); // best effort, ftruncate below sets the size
+#endif
+    return ftruncate(fd, size);
+}
+
+/*
+ * open_payload - open the output file of the connection's next transfer,
+ * named into f_name, with room for size bytes, and drop the file that
+ * falls out of the last RECEIVE_KEEP; -1 after reporting the error,
+ * leaving no allocation behind
+ */
+static int open_payload(connection *conn, uint64_t size, int flags, char *f_name, size_t len) {
+    char old_name[64];
+    unsigned n = conn->transfers++;
+    int fd;
+
+    if (n >= RECEIVE_KEEP) {
+        snprintf(old_name, sizeof(old_name), RECEIVE_DIR "/%d-%u.png", conn->id, n - RECEIVE_KEEP);
+        unlink(old_name);
+    }
+    snprintf(f_name, len, RECEIVE_DIR "/%d-%u.png", conn->id, n);
+    fd = open(f_name, flags | O_CREAT | O_TRUNC, (mode_t)0644);
+    if (fd == -1) {
+        fprintf(stderr, "[conn %d] ERROR opening %s: %s\n", conn->id, f_name, strerror(errno));
+        return -1;
+    }
+    if (allocate_file(fd, size) == -1) {
+        fprintf(stderr, "[conn %d] ERROR allocating %llu bytes for %s: %s\n", conn->id,
+                (unsigned long long)size, f_name, strerror(errno));
+        close(fd);
+        unlink(f_name);
+        return -1;
+    }
+    return fd;
+}
+
+/* send_reply - answer a transfer; -1 if the client has gone, which only ends its connection */
+static int send_reply(connection *conn, const frame_reply *reply) {
+    if (write(conn->childfd, reply, sizeof(*reply)) != sizeof(*reply)) {
+        fprintf(stderr, "[conn %d] ERROR writing the reply: %s\n", conn->id, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * check_trailer - read the CRC trailer of a checked frame and compare it
+ * with the CRC of what actually arrived; -1 if the trailer cannot be read
+ */
+static int check_trailer(connection *conn, int check, uint32_t crc, frame_reply *reply) {
+    uint32_t sent;
+
+    reply->crc = 0;
+    reply->crc_status = CRC_NONE;
+    if (!check)
+        return 0;
+    if (read_full(conn->childfd, &sent, sizeof(sent)) <= 0)
+        return -1;
+    reply->crc = crc32c_end(crc);
+    reply->crc_status = reply->crc == sent ? CRC_OK : CRC_BAD;
+    if (reply->crc_status == CRC_BAD)
+        fprintf(stderr, "[conn %d] CRC mismatch: sent %08x, received %08x\n",
+                conn->id, sent, reply->crc);
+    return 0;
+}
+
+static int ring_push(spsc_ring *r, write_job job) {
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&r->head, memory_order_acquire) == RING_SLOTS)
+        return 0;
+    r->slots[tail % RING_SLOTS] = job;
+    // sequentially consistent so a parked writer cannot miss the push
+    atomic_store(&r->tail, tail + 1);
+    return 1;
+}
+
+static int ring_pop(spsc_ring *r, write_job *job) {
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head == atomic_load(&r->tail))
+        return 0;
+    *job = r->slots[head % RING_SLOTS];
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return 1;
+}
+
+/* writer_progress - wake the receive thread if it sleeps on the writer */
+static void writer_progress(disk_writer *w) {
+    if (atomic_load(&w->waiting)) {
+        pthread_mutex_lock(&w->lock);
+        pthread_cond_signal(&w->progress);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+/* writer_main - drain filled buffers to their files until told to stop */
+static void *writer_main(void *arg) {
+    disk_writer *w = arg;
+    write_job job;
+    ssize_t n;
+    uint32_t done;
+
+    while (1) {
+        if (!ring_pop(&w->filled, &job)) {
+            pthread_mutex_lock(&w->lock);
+            atomic_store(&w->parked, 1);
+            while (atomic_load(&w->filled.head) == atomic_load(&w->filled.tail))
+                pthread_cond_wait(&w->wake, &w->lock);
+            atomic_store(&w->parked, 0);
+            pthread_mutex_unlock(&w->lock);
+            continue;
+        }
+        if (job.buf == WRITE_STOP)
+            break;
+        if (job.buf == WRITE_END) {
+            close(job.fd);
+            atomic_store(&w->drained, now_us());
+            atomic_fetch_add(&w->finished, 1);
+            writer_progress(w);
+            continue;
+        }
+        for (done = 0; done < job.len; done += n) {
+            n = pwrite(job.fd, w->pool + (size_t)job.buf * POOL_BUFSIZE + done,
+                       job.len - done, job.offset + done);
+            if (n <= 0) {
+                perror("ERROR writing received file");
+                break;
+            }
+        }
+        ring_push(&w->free, job); // never full: it holds at most POOL_BUFFERS
+        writer_progress(w);
+    }
+    return NULL;
+}
+
+/* writer_submit - queue a job for the writer and wake it if it is parked */
+static void writer_submit(disk_writer *w, write_job job) {
+    while (!ring_push(&w->filled, job))
+        sched_yield();
+    if (atomic_load(&w->parked)) {
+        pthread_mutex_lock(&w->lock);
+        pthread_cond_signal(&w->wake);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+/* pool_take - take a free buffer, sleeping until the writer returns one; 1 if it had to */
+static int pool_take(disk_writer *w, write_job *job) {
+    if (ring_pop(&w->free, job))
+        return 0;
+    pthread_mutex_lock(&w->lock);
+    atomic_store(&w->waiting, 1);
+    while (!ring_pop(&w->free, job))
+        pthread_cond_wait(&w->progress, &w->lock);
+    atomic_store(&w->waiting, 0);
+    pthread_mutex_unlock(&w->lock);
+    return 1;
+}
+
+/* writer_await - sleep until the writer has closed its target-th transfer */
+static void writer_await(disk_writer *w, unsigned target) {
+    if (atomic_load(&w->finished) == target)
+        return;
+    pthread_mutex_lock(&w->lock);
+    atomic_store(&w->waiting, 1);
+    while (atomic_load(&w->finished) != target)
+        pthread_cond_wait(&w->progress, &w->lock);
+    atomic_store(&w->waiting, 0);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static disk_writer *writer_start(void) {
+    disk_writer *w = calloc(1, sizeof(disk_writer));
+    write_job job = { -1, 0, 0, 0 };
+
+    if (w == NULL || (w->pool = malloc((size_t)POOL_BUFFERS * POOL_BUFSIZE)) == NULL)
+        error("ERROR allocating buffer pool");
+    for (job.buf = 0; job.buf < POOL_BUFFERS; job.buf++)
+        ring_push(&w->free, job);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->wake, NULL);
+    pthread_cond_init(&w->progress, NULL);
+    if (pthread_create(&w->thread, NULL, writer_main, w) != 0)
+        error("ERROR creating writer thread");
+    return w;
+}
+
+static void writer_stop(disk_writer *w) {
+    write_job job = { -1, WRITE_STOP, 0, 0 };
+    writer_submit(w, job);
+    pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->wake);
+    pthread_cond_destroy(&w->progress);
+    free(w->pool);
+    free(w);
+}
+
+/*
+ * serve_latency_async - receive one payload into pool buffers, queueing
+ * each for the writer as it fills, so a slow disk only holds reading up
+ * once the whole pool is waiting on it
+ */
+static int serve_latency_async(connection *conn, uint64_t size, uint64_t t_header, int check) {
+    disk_writer *w = conn->writer;
+    char f_name[64];
+    frame_reply reply;
+    write_job job;
+    unsigned target, stalls = 0;
+    uint64_t got = 0;
+    uint32_t fill, crc = crc32c_begin();
+    int fd, n, ok = 1;
+
+    reply.t_header = t_header;
+    reply.t_first = 0;
+
+    printf("Size: %llu\n", (unsigned long long)size);
+
+    fd = open_payload(conn, size, O_WRONLY, f_name, sizeof(f_name));
+    if (fd == -1)
+        return -1;
+
+    while (ok && got < size) {
+        stalls += pool_take(w, &job);
+        job.fd = fd;
+        job.offset = got;
+        job.len = 0;
+        fill = size - got < POOL_BUFSIZE ? size - got : POOL_BUFSIZE;
+        while (job.len < fill) {
+            n = read(conn->childfd, w->pool + (size_t)job.buf * POOL_BUFSIZE + job.len, fill - job.len);
+            if (n <= 0) {
+                ok = 0;
+                break;
+            }
+            if (got == 0 && job.len == 0)
+                reply.t_first = now_us();
+            if (check)
+                crc = crc32c_update(crc, w->pool + (size_t)job.buf * POOL_BUFSIZE + job.len, n);
+            job.len += n;
+        }
+        got += job.len;
+        writer_submit(w, job);
+    }
+
+    reply.t_finish = now_us();
+    if (size == 0)
+        reply.t_first = reply.t_finish;
+
+    // the writer closes the file once everything queued before this mark is on it
+    target = atomic_load(&w->finished) + 1;
+    job.fd = fd;
+    job.buf = WRITE_END;
+    writer_submit(w, job);
+    writer_await(w, target);
+    reply.disk_us = atomic_load(&w->drained) > reply.t_finish ? atomic_load(&w->drained) - reply.t_finish : 0;
+    if (!ok)
+        unlink(f_name); // a cut-off payload would only hold its whole allocation
+    if (!ok || check_trailer(conn, check, crc, &reply) < 0)
+        return -1;
+
+    printf("t_finish: %llu, header %llu, first byte %llu, disk backlog %llu us, pool empty %u times\n",
+           (unsigned long long)reply.t_finish, (unsigned long long)reply.t_header,
+           (unsigned long long)reply.t_first, (unsigned long long)reply.disk_us, stalls);
+
+    if (send_reply(conn, &reply) < 0)
+        return -1;
+
+    printf("ok!\n");
+    return 0;
+}
+
+/*
+ * serve_latency - receive one payload straight into a mapping of its own
+ * output file and answer with when its pieces arrived
+ */
+static int serve_latency(connection *conn, uint64_t size, uint64_t t_header, int check) {
+    char f_name[64];
+    frame_reply reply;
+    uint64_t t_disk;
+    char *map = NULL;
+    uint32_t crc = crc32c_begin();
+    int fd, n, ok = 1;
+
+    reply.t_header = t_header;
+    reply.t_first = 0;
+    reply.disk_us = 0;
+
+    printf("Size: %llu\n", (unsigned long long)size);
+
+    fd = open_payload(conn, size, O_RDWR, f_name, sizeof(f_name));
+    if (fd == -1)
+        return -1;
+    if (size > 0) {
+        map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("ERROR mmapping file");
+            close(fd);
+            unlink(f_name);
+            return -1;
+        }
+    }
+    /*
+     * read: the kernel copies the payload straight into the page cache
+     */
+    uint64_t recConunt = 0;
+    while(recConunt < size){
+        n = read(conn->childfd, map + recConunt, size - recConunt);
+        if (n <= 0) {
+            ok = 0;
+            break;
+        }
+        if (recConunt == 0)
+            reply.t_first = now_us();
+        // fold the bytes in while they are still in cache
+        if (check)
+            crc = crc32c_update(crc, map + recConunt, n);
+        recConunt += n;
+    }
+
+    reply.t_finish = now_us();
+    if (size == 0)
+        reply.t_first = reply.t_finish;
+
+    // Dirty pages are written back by the kernel; this is only the unmap
+    t_disk = now_us();
+    if (map != NULL)
+        munmap(map, size);
+    close(fd);
+    reply.disk_us = now_us() - t_disk;
+    if (!ok)
+        unlink(f_name); // a cut-off payload would only hold its whole allocation
+    if (!ok || check_trailer(conn, check, crc, &reply) < 0)
+        return -1;
+
+    printf("t_finish: %llu, header %llu, first byte %llu, disk %llu us\n",
+           (unsigned long long)reply.t_finish, (unsigned long long)reply.t_header,
+           (unsigned long long)reply.t_first, (unsigned long long)reply.disk_us);
+
+    if (send_reply(conn, &reply) < 0)
+        return -1;
+
+    printf("ok!\n");
+    return 0;
+}
+
+static void transfer_name(char *f_name, size_t len, const striped_transfer *t) {
+    snprintf(f_name, len, RECEIVE_DIR "/%s-%llx.png", t->hostaddr, (unsigned long long)t->transfer);
+}
+
+/* bury_transfer - leave a failed transfer's slot as a tombstone and drop its file; lock held */
+static void bury_transfer(striped_transfer *t) {
+    char f_name[96];
+
+    transfer_name(f_name, sizeof(f_name), t);
+    unlink(f_name);
+    t->failed = 1;
+    t->expires = time(NULL) + STRIPE_TIMEOUT;
+}
+
+/* close_transfer - hand a reassembled payload back to the kernel; lock held */
+static void close_transfer(striped_transfer *t) {
+    uint64_t t_disk = now_us();
+    if (t->map != NULL)
+        munmap(t->map, t->total);
+    close(t->fd);
+    t->map = NULL;
+    t->fd = -1;
+    t->reply.disk_us = now_us() - t_disk;
+}
+
+/*
+ * join_transfer - find the slot of a striped transfer, opening its file
+ * on the first stripe; NULL after saying why if the stripe cannot join.
+ * Lock held.
+ */
+static striped_transfer *join_transfer(connection *conn, const stripe_header *stripe) {
+    char f_name[96];
+    striped_transfer *t = NULL, *oldest = NULL;
+    time_t now = time(NULL);
+    int i;
+
+    for (i = 0; i < MAX_TRANSFERS; i++)
+        if (transfers[i].used && transfers[i].transfer == stripe->transfer &&
+            strcmp(transfers[i].hostaddr, conn->hostaddr) == 0) {
+            t = &transfers[i];
+            break;
+        }
+    if (t != NULL && t->expires != 0 && t->expires <= now) {
+        t->used = 0; // the tombstone has served its time
+        t = NULL;
+    }
+    if (t != NULL) {
+        if (t->failed) {
+            fprintf(stderr, "[conn %d] transfer %llx already failed, closing\n", conn->id,
+                    (unsigned long long)stripe->transfer);
+            return NULL;
+        }
+        if (t->total != stripe->total || t->count != stripe->count) {
+            fprintf(stderr, "[conn %d] stripe disagrees with transfer %llx, closing\n", conn->id,
+                    (unsigned long long)stripe->transfer);
+            return NULL;
+        }
+        t->attached++;
+        return t;
+    }
+    // a free slot, else the tombstone closest to expiring
+    for (i = 0; i < MAX_TRANSFERS && t == NULL; i++) {
+        if (!transfers[i].used)
+            t = &transfers[i];
+        else if (transfers[i].expires != 0 && (oldest == NULL || transfers[i].expires < oldest->expires))
+            oldest = &transfers[i];
+    }
+    if (t == NULL)
+        t = oldest;
+    if (t == NULL) {
+        fprintf(stderr, "[conn %d] no room for transfer %llx, closing\n", conn->id,
+                (unsigned long long)stripe->transfer);
+        return NULL;
+    }
+
+    t->used = 1;
+    t->expires = 0;
+    t->transfer = stripe->transfer;
+    snprintf(t->hostaddr, sizeof(t->hostaddr), "%s", conn->hostaddr);
+    t->total = stripe->total;
+    t->count = stripe->count;
+    t->landed = 0;
+    t->attached = 1;
+    t->failed = 0;
+    t->map = NULL;
+    memset(&t->reply, 0, sizeof(t->reply));
+
+    transfer_name(f_name, sizeof(f_name), t);
+    t->fd = open(f_name, O_RDWR | O_CREAT | O_TRUNC, (mode_t)0644);
+    if (t->fd == -1 || allocate_file(t->fd, stripe->total) == -1 ||
+        (stripe->total > 0 &&
+         (t->map = mmap(0, stripe->total, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0)) == MAP_FAILED)) {
+        fprintf(stderr, "[conn %d] ERROR setting up %s for %llu bytes: %s\n", conn->id, f_name,
+                (unsigned long long)stripe->total, strerror(errno));
+        if (t->fd != -1)
+            close(t->fd);
+        t->fd = -1;
+        t->map = NULL;
+        t->attached = 0;
+        bury_transfer(t); // the other stripes of this transfer fail at once
+        return NULL;
+    }
+    pthread_cond_init(&t->done, NULL);
+    return t;
+}
+
+/*
+ * serve_stripe - receive one stripe of a striped payload into its place
+ * in the shared mapping, then wait for the rest of the transfer and
+ * answer with the times of the whole payload
+ */
+static int serve_stripe(connection *conn, uint64_t size, uint64_t t_header, int check) {
+    stripe_header stripe;
+    striped_transfer *t;
+    frame_reply reply, checked;
+    uint64_t t_first = 0, t_finish, got = 0;
+    uint32_t crc = crc32c_begin();
+    struct timespec deadline;
+    int n, ok = 1;
+
+    if (read_full(conn->childfd, &stripe, sizeof(stripe)) <= 0)
+        return -1;
+    if (stripe.count == 0 || stripe.total > MAX_PAYLOAD || stripe.offset > stripe.total ||
+        size > stripe.total - stripe.offset) {
+        fprintf(stderr, "[conn %d] bad stripe %llu+%llu of %llu, closing\n", conn->id,
+                (unsigned long long)stripe.offset, (unsigned long long)size,
+                (unsigned long long)stripe.total);
+        return -1;
+    }
+
+    pthread_mutex_lock(&transfers_lock);
+    t = join_transfer(conn, &stripe);
+    pthread_mutex_unlock(&transfers_lock);
+    if (t == NULL)
+        return -1;
+
+    // stripes cover disjoint ranges, so they fill the mapping without the lock
+    while (got < size) {
+        n = read(conn->childfd, t->map + stripe.offset + got, size - got);
+        if (n <= 0) {
+            ok = 0;
+            break;
+        }
+        if (got == 0)
+            t_first = now_us();
+        if (check)
+            crc = crc32c_update(crc, t->map + stripe.offset + got, n);
+        got += n;
+    }
+    t_finish = now_us();
+    if (size == 0)
+        t_first = t_finish;
+    if (ok && check_trailer(conn, check, crc, &checked) < 0)
+        ok = 0;
+
+    pthread_mutex_lock(&transfers_lock);
+    if (ok) {
+        if (t->reply.t_header == 0 || t_header < t->reply.t_header)
+            t->reply.t_header = t_header;
+        if (t->reply.t_first == 0 || t_first < t->reply.t_first)
+            t->reply.t_first = t_first;
+        if (t_finish > t->reply.t_finish)
+            t->reply.t_finish = t_finish;
+        // one bad stripe spoils the transfer
+        if (checked.crc_status > t->reply.crc_status)
+            t->reply.crc_status = checked.crc_status;
+    } else {
+        t->failed = 1;
+    }
+    if (++t->landed == t->count) {
+        close_transfer(t);
+        printf("transfer %llx from %s: %u stripes, %llu bytes, complete at %llu\n",
+               (unsigned long long)t->transfer, t->hostaddr, t->count,
+               (unsigned long long)t->total, (unsigned long long)t->reply.t_finish);
+        pthread_cond_broadcast(&t->done);
+    }
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += STRIPE_TIMEOUT;
+    while (t->landed < t->count && !t->failed)
+        if (pthread_cond_timedwait(&t->done, &transfers_lock, &deadline) != 0)
+            t->failed = 1;
+    if (t->failed)
+        pthread_cond_broadcast(&t->done);
+    ok = ok && !t->failed;
+    reply = t->reply;
+    if (--t->attached == 0) {
+        if (t->fd != -1)
+            close_transfer(t);
+        pthread_cond_destroy(&t->done);
+        if (t->failed)
+            bury_transfer(t);
+        else
+            t->used = 0;
+    }
+    pthread_mutex_unlock(&transfers_lock);
+    if (!ok)
+        return -1;
+
+    reply.crc = checked.crc; // each connection hears the CRC of its own stripe
+    if (send_reply(conn, &reply) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * serve_stream - sink a throughput stream until the client closes,
+ * reporting bytes received in every interval
+ */
+static void serve_stream(connection *conn) {
+    static char sink[STREAM_BUFSIZE]; /* contents are never looked at, so threads may share it */
+    double start = now_seconds(), mark = start, t;
+    unsigned long long total = 0, interval_bytes = 0;
+    int n;
+
+    printf("[conn %d] stream from %s started at %.6f\n", conn->id, conn->hostaddr, start);
+    while ((n = read(conn->childfd, sink, STREAM_BUFSIZE)) > 0) {
+        total += n;
+        interval_bytes += n;
+        t = now_seconds();
+        if (t - mark >= report_interval) {
+            printf("[conn %d] %.6f %llu bytes in %.3f s, %.2f Mbit/s\n", conn->id, t,
+                   interval_bytes, t - mark, interval_bytes * 8 / (t - mark) / 1e6);
+            interval_bytes = 0;
+            mark = t;
+        }
+    }
+    t = now_seconds();
+    printf("[conn %d] stream ended at %.6f: %llu bytes in %.3f s, %.2f Mbit/s\n", conn->id, t,
+           total, t - start, t > start ? total * 8 / (t - start) / 1e6 : 0);
+}
+
+/*
+ * serve_connection - read frames off one connection until it closes
+ */
+static void *serve_connection(void *arg) {
+    connection *conn = arg;
+    frame_header header;
+    int n, check;
+
+    while(1) {
+        printf("Reading Picture Size\n");
+        n = read_full(conn->childfd, &header, sizeof(header));
+        if (n < 0)
+            perror("ERROR reading from socket");
+        if (n <= 0)
+            break;
+        uint64_t t_header = now_us();
+        if (header.magic != FRAME_MAGIC) {
+            fprintf(stderr, "[conn %d] bad frame magic 0x%x, closing\n", conn->id, header.magic);
+            break;
+        }
+        check = (header.type & FRAME_CRC) != 0;
+        header.type &= ~FRAME_CRC;
+        if (header.type == FRAME_STREAM) {
+            serve_stream(conn);
+            break;
+        }
+        if (header.type == FRAME_STRIPE) {
+            if (serve_stripe(conn, header.size, t_header, check) < 0)
+                break;
+            continue;
+        }
+        if (header.type != FRAME_LATENCY)
+            break;
+        if (header.size > MAX_PAYLOAD) {
+            fprintf(stderr, "[conn %d] payload of %llu bytes is over the %llu limit, closing\n", conn->id,
+                    (unsigned long long)header.size, (unsigned long long)MAX_PAYLOAD);
+            break;
+        }
+        if (async_disk && conn->writer == NULL)
+            conn->writer = writer_start();
+        if ((conn->writer ? serve_latency_async(conn, header.size, t_header, check)
+                          : serve_latency(conn, header.size, t_header, check)) < 0)
+            break;
+    }
+
+    if (conn->writer != NULL)
+        writer_stop(conn->writer);
+    close(conn->childfd);
+    free(conn);
+    return NULL;
+}
+
 int main(int argc, char **argv) {
     int parentfd; /* parent socket */
     int childfd; /* child socket */
     int portno; /* port to listen on */
-    int clientlen; /* byte size of client's address */
+    socklen_t clientlen; /* byte size of client's address */
     struct sockaddr_in serveraddr; /* server's addr */
     struct sockaddr_in clientaddr; /* client addr */
-    char buf[BUFSIZE]; /* message buffer */
-    char *hostaddrp; /* dotted decimal host addr string */
     int optval; /* flag value for setsockopt */
-    int n; /* message byte size */
-    
+    int opt, nconn = 0;
+
     /*
      * check command line arguments
      */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "i:W")) != -1) {
+        switch (opt) {
+        case 'i':
+            report_interval = atof(optarg);
+            break;
+        case 'W':
+            async_disk = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-i interval] [-W] <port>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "usage: %s [-i interval] [-W] <port>\n", argv[0]);
         exit(1);
     }
-    portno = atoi(argv[1]);
-    
+    portno = atoi(argv[optind]);
+    crc32c_init();
+    // a client that hangs up before its reply must not take the other connections down
+    signal(SIGPIPE, SIG_IGN);
+    if (mkdir(RECEIVE_DIR, 0755) == -1 && errno != EEXIST)
+        error("ERROR creating " RECEIVE_DIR);
+
     /*
      * socket: create the parent socket
      */
     parentfd = socket(AF_INET, SOCK_STREAM, 0);
     if (parentfd < 0)
         error("ERROR opening socket");
-    
+
     /* setsockopt: Handy debugging trick that lets
      * us rerun the server immediately after we kill it;
      * otherwise we have to wait about 20 secs.
@@ -59,103 +904,63 @@ int main(int argc, char **argv) {
      */
     optval = 1;
     setsockopt(parentfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval , sizeof(int));
-    
+
     /*
      * build the server's Internet address
      */
     bzero((char *) &serveraddr, sizeof(serveraddr));
-    
+
     /* this is an Internet address */
     serveraddr.sin_family = AF_INET;
-    
+
     /* let the system figure out our IP address */
     serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    
+
     /* this is the port we will listen on */
     serveraddr.sin_port = htons((unsigned short)portno);
-    
+
     /*
      * bind: associate the parent socket with a port
      */
     if (bind(parentfd, (struct sockaddr *) &serveraddr, sizeof(serveraddr)) < 0)
         error("ERROR on binding");
-    
+
     /*
      * listen: make this socket ready to accept connection requests
      */
     if (listen(parentfd, 5) < 0) /* allow 5 requests to queue up */
         error("ERROR on listen");
-    
-    /*
-     * main loop: wait for a connection request, echo input line,
-     * then close connection.
-     */
-    clientlen = sizeof(clientaddr);
-        
+
     /*
-     * accept: wait for a connection request
+     * main loop: wait for a connection request and hand it to its own thread
      */
-    childfd = accept(parentfd, (struct sockaddr *) &clientaddr, (socklen_t *) &clientlen);
-    if (childfd < 0)
-        error("ERROR on accept");
-
-    hostaddrp = inet_ntoa(clientaddr.sin_addr);
-    if (hostaddrp == NULL)
-        error("ERROR on inet_ntoa\n");
-    
-    while(1) {
-        printf("Reading Picture Size\n");
-        int size, tag = 0;
-        
-        n = read(childfd, &size, sizeof(int));
-        if (n < 0)
-            error("ERROR reading from socket");
-        printf("Size: %d\n", size);
-        
-        //n = read(childfd, &tag, sizeof(int));
-        //if (n < 0)
-        //    error("ERROR reading from socket");
-        //printf("Tag: %d\n", tag);
-        
-        char* f_name = "receive.png";
-        FILE *fp = fopen(f_name, "wb");
-        if(fp == NULL) error("ERROR open file");
+    while (1) {
+        pthread_t thread;
+        connection *conn;
+
         /*
-         * read: read input string from the client
+         * accept: wait for a connection request
          */
-        bzero(buf, BUFSIZE);
-        int recConunt = 0;
-        while(recConunt < size){
-            n = read(childfd, buf, BUFSIZE);
-            if (n < 0)
-                error("ERROR reading from socket");
-            int write_sz = fwrite(buf, sizeof(char), n, fp);
-            if(write_sz < n){
-                error("ERROR write file");
-            }
-            recConunt += n;
-            bzero(buf, BUFSIZE);
-            
-        }
-        
-        struct timeval tv_finish;
-        gettimeofday(&tv_finish, NULL);
-        
-        printf("RECe Sec Usec: %ld， %d\n", tv_finish.tv_sec, tv_finish.tv_usec);
-        uint64_t t_finish = (uint64_t)tv_finish.tv_sec * 1000000 + tv_finish.tv_usec;
-        printf("t_finish: %llu\n", t_finish);
-        
-       // n = write(childfd, &tag, sizeof(int));
-       // if (n < 0)
-       //     error("ERROR writing to socket");
-        n = write(childfd, &t_finish, sizeof(uint64_t));
-        if (n < 0)
-            error("ERROR writing to socket");
-        
-        printf("ok!\n");
-        fclose(fp);
+        clientlen = sizeof(clientaddr);
+        childfd = accept(parentfd, (struct sockaddr *) &clientaddr, &clientlen);
+        if (childfd < 0)
+            error("ERROR on accept");
+
+        conn = malloc(sizeof(connection));
+        if (conn == NULL)
+            error("ERROR allocating connection");
+        conn->childfd = childfd;
+        conn->id = nconn++;
+        conn->transfers = 0;
+        conn->writer = NULL;
+        if (inet_ntop(AF_INET, &clientaddr.sin_addr, conn->hostaddr, sizeof(conn->hostaddr)) == NULL)
+            error("ERROR on inet_ntop\n");
+
+        if (pthread_create(&thread, NULL, serve_connection, conn) != 0)
+            error("ERROR creating connection thread");
+        pthread_detach(thread);
     }
-    
-    close(childfd);
+
+    close(parentfd);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,7 +1,36 @@
 /*
  * udpserver.c - A simple UDP echo server
- * usage: udpserver <port>
+ * usage: udpserver [-j threads] [-r rate] [-b burst] [-I] [-K] [-w mode] [-s us] [-c cpu]
+ *                  [-M group:port [-P secs] [-i addr]] <port>
+ *   -j  number of worker threads (default 1)
+ *   -r  packets per second allowed per client address, 0 disables limiting (default 100)
+ *   -b  burst of back-to-back packets allowed per client address (default 1024)
+ *   -I  interleaved mode: capture each reply's kernel transmit time-stamp
+ *       and return it in the next reply to the same client (Linux only)
+ *   -K  stamp rxTm with the kernel receive time (SO_TIMESTAMPNS, or
+ *       SO_TIMESTAMP where that is missing) instead of after recvfrom
+ *   -w  how workers wait for a request:
+ *         block     sleep in recvfrom (default)
+ *         spin      poll the socket with non-blocking receives, never sleeping
+ *         busypoll  sleep in recvfrom with SO_BUSY_POLL set, so the kernel
+ *                   polls the device queue for -s us first (Linux only)
+ *         hybrid    spin for -s us after each request, then sleep in poll()
+ *   -s  spin budget in microseconds for busypoll and hybrid (default 50)
+ *   -c  pin worker i to cpu c+i, to give a spinning worker a core of its
+ *       own (Linux only)
+ *   -M  also send a time-stamped broadcast-mode packet to this multicast
+ *       group every -P seconds (default 1), leaving the group interface to
+ *       -i (default: the routing table's choice). The cost is one send per
+ *       interval however many clients listen.
+ *
+ * Every reply carries the server's residence time, from receiving the
+ * request (the kernel stamp with -K) to handing the reply back to the
+ * kernel, and with -K the time from the kernel stamp to the worker
+ * seeing the request, so clients can see what each wait mode buys.
  */
+#ifdef __linux__
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
 
 #include <stdio.h>
 #include <unistd.h>
@@ -13,33 +42,96 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sched.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#endif
 
 /* NTP packet */
 typedef struct{
-    //unsigned li   : 2;       // Only two bits. Leap indicator.
-    //unsigned vn   : 3;       // Only three bits. Version number of the protocol.
-    //unsigned mode : 3;       // Only three bits. Mode. Client will pick mode 3 for client.
-    
-    //uint8_t stratum;         // Eight bits. Stratum level of the local clock.
-    //uint8_t poll;            // Eight bits. Maximum interval between successive messages.
-    //uint8_t precision;       // Eight bits. Precision of the local clock.
-    
-    //uint32_t rootDelay;      // 32 bits. Total round trip delay time.
-    //uint32_t rootDispersion; // 32 bits. Max error aloud from primary clock source.
-    //uint32_t refId;          // 32 bits. Reference clock identifier.
-    
+    uint8_t li_vn_mode;      // Eight bits. li (2 bits, leap indicator), vn (3 bits, version number)
+                             // and mode (3 bits, 3 for client, 4 for server).
+
+    uint8_t stratum;         // Eight bits. Stratum level of the local clock, 0 for Kiss-o'-Death.
+    uint8_t poll;            // Eight bits. Maximum interval between successive messages.
+    uint8_t precision;       // Eight bits. Precision of the local clock.
+
+    uint32_t rootDelay;      // 32 bits. Total round trip delay time.
+    uint32_t rootDispersion; // 32 bits. Max error aloud from primary clock source.
+    uint32_t refId;          // 32 bits. Reference clock identifier, or the Kiss-o'-Death code.
+
     uint32_t refTm_s;        // 32 bits. Reference time-stamp seconds.
     uint32_t refTm_f;        // 32 bits. Reference time-stamp fraction of a second.
-    
+
     uint32_t origTm_s;       // 32 bits. Originate time-stamp seconds.
     uint32_t origTm_f;       // 32 bits. Originate time-stamp fraction of a second.
-    
+
     uint32_t rxTm_s;         // 32 bits. Received time-stamp seconds.
     uint32_t rxTm_f;         // 32 bits. Received time-stamp fraction of a second.
-    
+
     uint32_t txTm_s;         // 32 bits and the most important field the client cares about. Transmit time-stamp seconds.
     uint32_t txTm_f;         // 32 bits. Transmit time-stamp fraction of a second.
-} ntp_packet;                // Total: 384 bits or 48 bytes.
+
+    uint32_t prevOrigTm_s;   // 32 bits. Interleaved mode: originate time-stamp of the previous exchange, seconds.
+    uint32_t prevOrigTm_f;   // 32 bits. Interleaved mode: originate time-stamp of the previous exchange, fraction.
+    uint32_t prevTxTm_s;     // 32 bits. Interleaved mode: actual transmit time-stamp of the previous reply, seconds.
+    uint32_t prevTxTm_f;     // 32 bits. Interleaved mode: actual transmit time-stamp of the previous reply, fraction.
+
+    uint32_t residence_ns;   // 32 bits. Server time from receiving the request to sending the reply, ns.
+    uint32_t wake_ns;        // 32 bits. Server time from the kernel receive stamp to the worker seeing the request, ns.
+} ntp_packet;                // Total: 576 bits or 72 bytes, the NTP header, the interleaved extension and the residence report.
+
+#define NTP_VERSION 4
+#define NTP_MODE_SERVER 4
+#define NTP_MODE_BROADCAST 5
+#define NTP_LI_ALARM 3
+#define KOD_RATE 0x52415445  // "RATE"
+
+/*
+ * Client table: fixed-size, open-addressed and lock-free, keyed by the
+ * client's IPv4 address. Each slot holds a token bucket kept in GCRA
+ * form, i.e. as the single "theoretical arrival time" of the next
+ * packet, so admitting a packet is one compare-and-swap.
+ */
+#define CLIENT_TABLE_BITS 12
+#define CLIENT_TABLE_SIZE (1 << CLIENT_TABLE_BITS)
+#define CLIENT_PROBE_LIMIT 16
+#define CLIENT_IDLE_NS (60ULL*1000000000ULL) // slots idle this long may be reclaimed
+
+typedef struct{
+    _Atomic uint64_t key;  // address | CLIENT_KEY_USED, 0 when the slot is empty
+    _Atomic uint64_t tat;  // theoretical arrival time of the next packet, ns
+    _Atomic uint64_t prev_orig; // interleaved mode: origTm (s << 32 | f) of the last request answered
+    _Atomic uint64_t prev_tx;   // interleaved mode: kernel transmit time (s << 32 | us) of that reply
+} client_slot;
+
+#define CLIENT_KEY_USED (1ULL << 32)
+
+static client_slot client_table[CLIENT_TABLE_SIZE];
+static uint64_t rate_interval_ns;  // ns between packets at the sustained rate, 0 = unlimited
+static uint64_t rate_tolerance_ns; // how far ahead of real time a client may run
+static int interleaved;            // capture kernel transmit time-stamps for the next reply
+static int kernel_stamps;          // take rxTm from the kernel receive time-stamp
+
+#define WAIT_BLOCK 0
+#define WAIT_SPIN 1
+#define WAIT_BUSY_POLL 2
+#define WAIT_HYBRID 3
+
+static int wait_mode = WAIT_BLOCK;
+static int spin_us = 50;           // busy-poll / hybrid spin budget
+static int pin_cpu = -1;           // first cpu to pin workers to, -1 to leave them free
+
+static _Atomic unsigned long stat_served;
+static _Atomic unsigned long stat_kod;
+static _Atomic unsigned long stat_table_full;
 
 /*
  * error - wrapper for perror
@@ -49,33 +141,340 @@ void error(char *msg) {
     exit(1);
 }
 
-int main(int argc, char **argv) {
-    int sockfd; /* socket */
-    int portno; /* port to listen on */
-    int clientlen; /* byte size of client's address */
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* find or claim the slot for addr; NULL if its probe window is full and busy */
+static client_slot *client_lookup(uint32_t addr, uint64_t now) {
+    uint64_t key = addr | CLIENT_KEY_USED;
+    uint32_t h = (uint32_t)(((uint64_t)addr * 0x9E3779B97F4A7C15ULL) >> (64 - CLIENT_TABLE_BITS));
+    int i;
+
+    for (i = 0; i < CLIENT_PROBE_LIMIT; i++) {
+        client_slot *slot = &client_table[(h + i) & (CLIENT_TABLE_SIZE - 1)];
+        uint64_t cur = atomic_load_explicit(&slot->key, memory_order_acquire);
+        if (cur == key)
+            return slot;
+        if (cur == 0) {
+            if (atomic_compare_exchange_strong(&slot->key, &cur, key)) {
+                atomic_store_explicit(&slot->tat, now, memory_order_relaxed);
+                return slot;
+            }
+            if (cur == key) // another thread claimed it for the same client
+                return slot;
+            continue;
+        }
+        /*
+         * Reclaim a slot whose client has gone quiet. tat == 0 marks a
+         * claim still being set up, so it is never idle; swapping the
+         * stale tat for 0 first makes this thread the only reclaimer.
+         */
+        uint64_t tat = atomic_load_explicit(&slot->tat, memory_order_relaxed);
+        if (tat != 0 && tat + CLIENT_IDLE_NS < now &&
+            atomic_compare_exchange_strong(&slot->tat, &tat, 0)) {
+            atomic_store_explicit(&slot->key, key, memory_order_release);
+            atomic_store_explicit(&slot->tat, now, memory_order_relaxed);
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/* token bucket check on a client's slot; 1 if the packet may be answered normally */
+static int client_admit(client_slot *slot, uint64_t now) {
+    uint64_t tat, base;
+
+    if (rate_interval_ns == 0) {
+        // no bucket to fill, but keep the slot from looking idle
+        if (slot != NULL)
+            atomic_store_explicit(&slot->tat, now, memory_order_relaxed);
+        return 1;
+    }
+    if (slot == NULL) {
+        // Fail open: a full neighbourhood must not lock out legitimate clients
+        atomic_fetch_add_explicit(&stat_table_full, 1, memory_order_relaxed);
+        return 1;
+    }
+    tat = atomic_load_explicit(&slot->tat, memory_order_relaxed);
+    do {
+        base = tat > now ? tat : now;
+        if (base - now > rate_tolerance_ns)
+            return 0;
+    } while (!atomic_compare_exchange_weak_explicit(&slot->tat, &tat, base + rate_interval_ns,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    return 1;
+}
+
+/*
+ * Interleaved mode bookkeeping for one socket. The kernel numbers every
+ * datagram sent on the socket (SOF_TIMESTAMPING_OPT_ID) and hands the
+ * number back with its transmit stamp, so replies are remembered by that
+ * number until their stamp turns up, however late and in whatever order.
+ */
+#define TX_PENDING 256
+
+typedef struct{
+    uint32_t key;       // the datagram's number on its socket
+    client_slot *slot;  // client the reply went to, NULL for Kiss-o'-Death
+    uint64_t orig;      // origTm (s << 32 | f) of the request it answered
+} tx_pending;
+
+typedef struct{
+    int sockfd;
+    uint32_t sent;      // datagrams sent on sockfd, i.e. the next one's number
+    tx_pending pending[TX_PENDING];
+} tx_stamps;
+
+#ifdef __linux__
+/* ask the kernel for numbered software transmit time-stamps on the error queue */
+static void enable_tx_timestamps(int sockfd) {
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY |
+                SOF_TIMESTAMPING_OPT_ID;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+        error("ERROR enabling SO_TIMESTAMPING");
+}
+
+/*
+ * drain_tx_timestamps - take every transmit time-stamp waiting on the
+ * error queue without blocking, and file each with the client whose
+ * reply it belongs to. Stamps for Kiss-o'-Death replies, or for replies
+ * so old their entry has been reused, are dropped.
+ */
+static void drain_tx_timestamps(tx_stamps *tx) {
+    char control[256];
+    char data[64];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+
+    while (1) {
+        struct timespec *ts = NULL;
+        struct sock_extended_err *serr = NULL;
+
+        iov.iov_base = data;
+        iov.iov_len = sizeof(data);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(tx->sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+                ts = &((struct scm_timestamping *)CMSG_DATA(cmsg))->ts[0];
+            else if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+        }
+        if (ts == NULL || serr == NULL || serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+            continue;
+        tx_pending *p = &tx->pending[serr->ee_data % TX_PENDING];
+        if (p->key != serr->ee_data || p->slot == NULL)
+            continue;
+        atomic_store_explicit(&p->slot->prev_orig, 0, memory_order_release);
+        atomic_store_explicit(&p->slot->prev_tx, (uint64_t)ts->tv_sec << 32 | (uint32_t)(ts->tv_nsec / 1000),
+                              memory_order_release);
+        atomic_store_explicit(&p->slot->prev_orig, p->orig, memory_order_release);
+        p->slot = NULL;
+    }
+}
+#endif
+
+/* tx_sent - count a datagram sent on tx's socket, remembering whom it answered */
+static void tx_sent(tx_stamps *tx, client_slot *slot, uint64_t orig) {
+    tx_pending *p;
+
+    if (tx == NULL)
+        return;
+    p = &tx->pending[tx->sent % TX_PENDING];
+    p->key = tx->sent++;
+    p->slot = slot;
+    p->orig = orig;
+}
+
+typedef struct{
+    int sockfd;
+    int id;
+} worker_arg;
+
+/* where broadcast-mode packets go */
+typedef struct{
+    struct sockaddr_in group;
+    struct in_addr iface;
+    double interval;
+} broadcast_arg;
+
+/*
+ * broadcast - send one time-stamped packet to the group every interval;
+ * clients listening on the group calibrate the path delay themselves
+ */
+static void *broadcast(void *p) {
+    broadcast_arg *arg = p;
+    struct timespec next;
+    unsigned char ttl = 1, loop = 1;
+    unsigned long sent = 0;
+    ntp_packet packet;
+    uint64_t t_tx;
+    int sockfd;
+
+    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+        error("ERROR opening broadcast socket");
+    // one hop is enough for the lab network; loop lets a client on this host listen too
+    setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    if (arg->iface.s_addr != htonl(INADDR_ANY) &&
+        setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF, &arg->iface, sizeof(arg->iface)) < 0)
+        error("ERROR setting the multicast interface");
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1) {
+        memset(&packet, 0, sizeof(packet));
+        packet.li_vn_mode = (NTP_VERSION << 3) | NTP_MODE_BROADCAST;
+        packet.stratum = 1;
+        t_tx = realtime_ns();
+        packet.txTm_s = (uint32_t)(t_tx / 1000000000ULL);
+        packet.txTm_f = (uint32_t)(t_tx % 1000000000ULL / 1000);
+        if (sendto(sockfd, &packet, sizeof(packet), 0, (struct sockaddr *)&arg->group, sizeof(arg->group)) < 0)
+            perror("ERROR sending broadcast");
+        else if (++sent % 1000 == 0)
+            printf("broadcast: %lu packets sent\n", sent);
+
+        // absolute deadlines, so the send time does not drift the schedule
+        next.tv_sec += (time_t)arg->interval;
+        next.tv_nsec += (long)((arg->interval - (time_t)arg->interval) * 1e9);
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+#ifdef __linux__
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+#else
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double left = (next.tv_sec - now.tv_sec) + (next.tv_nsec - now.tv_nsec) / 1e9;
+        if (left > 0)
+            usleep((useconds_t)(left * 1e6));
+#endif
+    }
+    return NULL;
+}
+
+/* ask the kernel to stamp received datagrams */
+static void enable_rx_timestamps(int sockfd) {
+    int optval = 1;
+#ifdef SO_TIMESTAMPNS
+    if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &optval, sizeof(optval)) < 0)
+#else
+    if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMP, &optval, sizeof(optval)) < 0)
+#endif
+        error("ERROR enabling receive time-stamps");
+}
+
+/*
+ * recv_stamped - recvfrom that also hands back the kernel receive
+ * time-stamp, if one was attached. Returns the byte count; *stamped is
+ * 0 when no stamp came with the datagram.
+ */
+static int recv_stamped(int sockfd, void *buf, size_t len, struct sockaddr_in *addr, socklen_t *addrlen,
+                        struct timeval *stamp, int *stamped, int flags) {
+    char control[128];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int n;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = *addrlen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    *stamped = 0;
+    n = recvmsg(sockfd, &msg, flags);
+    if (n < 0)
+        return n;
+    *addrlen = msg.msg_namelen;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET)
+            continue;
+#ifdef SO_TIMESTAMPNS
+        if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec *ts = (struct timespec *)CMSG_DATA(cmsg);
+            stamp->tv_sec = ts->tv_sec;
+            stamp->tv_usec = ts->tv_nsec / 1000;
+            *stamped = 1;
+        }
+#else
+        if (cmsg->cmsg_type == SCM_TIMESTAMP) {
+            memcpy(stamp, CMSG_DATA(cmsg), sizeof(struct timeval));
+            *stamped = 1;
+        }
+#endif
+    }
+    return n;
+}
+
+/*
+ * recv_wait - recv_stamped that waits for the next request the way -w
+ * asks: in the kernel, by spinning on non-blocking receives, or by
+ * spinning for a while and then sleeping
+ */
+static int recv_wait(int sockfd, void *buf, size_t len, struct sockaddr_in *addr, socklen_t *addrlen,
+                     struct timeval *stamp, int *stamped, tx_stamps *tx) {
+    struct pollfd pfd = { sockfd, POLLIN, 0 };
+    socklen_t addrcap = *addrlen;
+    uint64_t give_up;
+    int n;
+
+    if (wait_mode == WAIT_BLOCK || wait_mode == WAIT_BUSY_POLL)
+        return recv_stamped(sockfd, buf, len, addr, addrlen, stamp, stamped, 0);
+    give_up = monotonic_ns() + (uint64_t)spin_us * 1000;
+    while (1) {
+        *addrlen = addrcap;
+        n = recv_stamped(sockfd, buf, len, addr, addrlen, stamp, stamped, MSG_DONTWAIT);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            return n;
+        if (wait_mode == WAIT_HYBRID && monotonic_ns() > give_up) {
+            // out of budget: sleep until something arrives, then spin afresh
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                return -1;
+#ifdef __linux__
+            // a late transmit stamp reads as POLLERR; take it so the next poll sleeps
+            if (tx != NULL && (pfd.revents & POLLERR))
+                drain_tx_timestamps(tx);
+#endif
+            give_up = monotonic_ns() + (uint64_t)spin_us * 1000;
+        }
+    }
+}
+
+/* open and bind a socket on portno; reuseport lets each worker own one */
+static int open_socket(int portno, int reuseport) {
     struct sockaddr_in serveraddr; /* server's addr */
-    struct sockaddr_in clientaddr; /* client addr */
-    struct hostent *hostp; /* client host info */
-    char *hostaddrp; /* dotted decimal host addr string */
     int optval; /* flag value for setsockopt */
-    int n; /* message byte size */
-    
-    /*
-     * check command line arguments
-     */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
-    }
-    portno = atoi(argv[1]);
-    
+    int sockfd;
+
     /*
      * socket: create the parent socket
      */
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0)
         error("ERROR opening socket");
-    
+
     /* setsockopt: Handy debugging trick that lets
      * us rerun the server immediately after we kill it;
      * otherwise we have to wait about 20 secs.
@@ -84,7 +483,12 @@ int main(int argc, char **argv) {
     optval = 1;
     setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
                (const void *)&optval , sizeof(int));
-    
+#ifdef SO_REUSEPORT
+    if (reuseport)
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+                   (const void *)&optval , sizeof(int));
+#endif
+
     /*
      * build the server's Internet address
      */
@@ -92,49 +496,129 @@ int main(int argc, char **argv) {
     serveraddr.sin_family = AF_INET;
     serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
     serveraddr.sin_port = htons((unsigned short)portno);
-    
+
     /*
      * bind: associate the parent socket with a port
      */
     if (bind(sockfd, (struct sockaddr *) &serveraddr,
              sizeof(serveraddr)) < 0)
         error("ERROR on binding");
-    
+#ifdef __linux__
+    if (interleaved)
+        enable_tx_timestamps(sockfd);
+#endif
+    if (kernel_stamps)
+        enable_rx_timestamps(sockfd);
+#ifdef SO_BUSY_POLL
+    if (wait_mode == WAIT_BUSY_POLL &&
+        setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &spin_us, sizeof(spin_us)) < 0)
+        perror("WARNING: SO_BUSY_POLL refused (raising it past net.core.busy_read needs CAP_NET_ADMIN)");
+#endif
+    return sockfd;
+}
+
+/*
+ * serve - answer datagrams on one socket until the process exits
+ */
+static void *serve(void *p) {
+    worker_arg *arg = p;
+    int sockfd = arg->sockfd;
+    socklen_t clientlen; /* byte size of client's address */
+    struct sockaddr_in clientaddr; /* client addr */
+    char hostaddr[INET_ADDRSTRLEN]; /* dotted decimal host addr string */
+    int n; /* message byte size */
+    struct timeval rx_stamp; /* kernel receive time */
+    int stamped;
+    tx_stamps *tx = NULL; /* interleaved mode: replies awaiting their transmit stamps */
+
     ntp_packet packet;
     memset( &packet, 0, sizeof( ntp_packet ) );
+#ifdef __linux__
+    if (pin_cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(pin_cpu + arg->id, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            fprintf(stderr, "[%d] could not pin to cpu %d\n", arg->id, pin_cpu + arg->id);
+    }
+    if (interleaved) {
+        tx = calloc(1, sizeof(tx_stamps));
+        if (tx == NULL)
+            error("ERROR allocating transmit stamp table");
+        tx->sockfd = sockfd;
+    }
+#endif
     /*
      * main loop: wait for a datagram, then echo it
      */
-    clientlen = sizeof(clientaddr);
     while (1) {
         /*
          * recvfrom: receive a UDP datagram from a client
          */
         bzero((char *) &packet, sizeof(packet));
-        n = recvfrom(sockfd, (char *) &packet, sizeof(packet), 0,
-                     (struct sockaddr *) &clientaddr, &clientlen);
+        clientlen = sizeof(clientaddr);
+        n = recv_wait(sockfd, (char *) &packet, sizeof(packet),
+                      &clientaddr, &clientlen, &rx_stamp, &stamped, tx);
         if (n < 0)
             error("ERROR in recvfrom");
+        uint64_t t_seen = realtime_ns();
+        uint64_t t_rx = stamped ? (uint64_t)rx_stamp.tv_sec * 1000000000ULL + rx_stamp.tv_usec * 1000ULL : t_seen;
+
+        client_slot *slot = NULL;
+        uint64_t now = 0;
+        if (rate_interval_ns != 0 || interleaved) {
+            now = monotonic_ns();
+            slot = client_lookup(ntohl(clientaddr.sin_addr.s_addr), now);
+        }
+        if (!client_admit(slot, now)) {
+            /*
+             * Kiss-o'-Death: echo the originate time so the client can
+             * match it, but skip the clock reads and the log line.
+             */
+            packet.li_vn_mode = (NTP_LI_ALARM << 6) | (NTP_VERSION << 3) | NTP_MODE_SERVER;
+            packet.stratum = 0;
+            packet.refId = htonl(KOD_RATE);
+            atomic_fetch_add_explicit(&stat_kod, 1, memory_order_relaxed);
+            if (sendto(sockfd, (char *) &packet, sizeof(packet), 0,
+                       (struct sockaddr *) &clientaddr, clientlen) >= 0)
+                tx_sent(tx, NULL, 0);
+            continue;
+        }
+
         struct timeval tv;
         // get the server receive time
-        gettimeofday(&tv, NULL);
+        if (stamped)
+            tv = rx_stamp;
+        else
+            gettimeofday(&tv, NULL);
         packet.rxTm_s = (uint32_t)tv.tv_sec;
         packet.rxTm_f = (uint32_t)tv.tv_usec;
-        
-        /*
-         * gethostbyaddr: determine who sent the datagram
-         */
-        hostp = gethostbyaddr((const char *)&clientaddr.sin_addr.s_addr,
-                              sizeof(clientaddr.sin_addr.s_addr), AF_INET);
-        
-        hostaddrp = inet_ntoa(clientaddr.sin_addr);
-        if (hostaddrp == NULL)
-            error("ERROR on inet_ntoa\n");
-        printf("server received %lu/%d bytes: %u, %u, %u, %u, %u, %u\n", sizeof(packet), n, packet.origTm_s, packet.origTm_f, packet.rxTm_s, packet.rxTm_f, packet.txTm_s, packet.txTm_f);
+
+        packet.li_vn_mode = (NTP_VERSION << 3) | NTP_MODE_SERVER;
+        packet.stratum = 1;
+        uint64_t orig = (uint64_t)packet.origTm_s << 32 | packet.origTm_f;
+#ifdef __linux__
+        // file the stamps of earlier replies, this client's last one among them
+        if (tx != NULL)
+            drain_tx_timestamps(tx);
+#endif
+        if (slot != NULL && interleaved) {
+            /* prev_orig doubles as a version: a changed value means a torn read */
+            uint64_t prev_orig = atomic_load_explicit(&slot->prev_orig, memory_order_acquire);
+            uint64_t prev_tx = atomic_load_explicit(&slot->prev_tx, memory_order_acquire);
+            if (prev_orig != 0 && prev_orig == atomic_load_explicit(&slot->prev_orig, memory_order_acquire)) {
+                packet.prevOrigTm_s = (uint32_t)(prev_orig >> 32);
+                packet.prevOrigTm_f = (uint32_t)prev_orig;
+                packet.prevTxTm_s = (uint32_t)(prev_tx >> 32);
+                packet.prevTxTm_f = (uint32_t)prev_tx;
+            }
+        }
         // get the server transmit time
-        gettimeofday(&tv, NULL);
-        packet.txTm_s = (uint32_t)tv.tv_sec;
-        packet.txTm_f = (uint32_t)tv.tv_usec;
+        uint64_t t_tx = realtime_ns();
+        packet.txTm_s = (uint32_t)(t_tx / 1000000000ULL);
+        packet.txTm_f = (uint32_t)(t_tx % 1000000000ULL / 1000);
+        packet.residence_ns = t_tx > t_rx ? (uint32_t)(t_tx - t_rx) : 0;
+        packet.wake_ns = stamped && t_seen > t_rx ? (uint32_t)(t_seen - t_rx) : 0;
         /*
          * sendto: echo the input back to the client
          */
@@ -142,5 +626,142 @@ int main(int argc, char **argv) {
                    (struct sockaddr *) &clientaddr, clientlen);
         if (n < 0)
             error("ERROR in sendto");
+        tx_sent(tx, slot, orig);
+        // log once the reply is out, so printing never counts as residence
+        if (inet_ntop(AF_INET, &clientaddr.sin_addr, hostaddr, sizeof(hostaddr)) == NULL)
+            error("ERROR on inet_ntop\n");
+        printf("[%d] server received %lu/%d bytes from %s: %u, %u, %u, %u, %u, %u, residence %u ns\n", arg->id, sizeof(packet), n, hostaddr, packet.origTm_s, packet.origTm_f, packet.rxTm_s, packet.rxTm_f, packet.txTm_s, packet.txTm_f, packet.residence_ns);
+        if (atomic_fetch_add_explicit(&stat_served, 1, memory_order_relaxed) % 10000 == 9999)
+            printf("served %lu, rate limited %lu, client table full %lu\n",
+                   atomic_load(&stat_served), atomic_load(&stat_kod), atomic_load(&stat_table_full));
     }
-}
\ No newline at end of file
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int portno; /* port to listen on */
+    int nthreads = 1;
+    double rate = 100;
+    int burst = 1024;
+    int reuseport = 0;
+    int opt, i;
+    broadcast_arg bcast;
+    char group[64];
+    int group_port = 0;
+
+    memset(&bcast, 0, sizeof(bcast));
+    bcast.interval = 1;
+    bcast.iface.s_addr = htonl(INADDR_ANY);
+
+    /*
+     * check command line arguments
+     */
+    while ((opt = getopt(argc, argv, "j:r:b:IKw:s:c:M:P:i:")) != -1) {
+        switch (opt) {
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'b':
+            burst = atoi(optarg);
+            break;
+        case 'I':
+            interleaved = 1;
+            break;
+        case 'K':
+            kernel_stamps = 1;
+            break;
+        case 'w':
+            if (strcmp(optarg, "block") == 0)
+                wait_mode = WAIT_BLOCK;
+            else if (strcmp(optarg, "spin") == 0)
+                wait_mode = WAIT_SPIN;
+            else if (strcmp(optarg, "busypoll") == 0)
+                wait_mode = WAIT_BUSY_POLL;
+            else if (strcmp(optarg, "hybrid") == 0)
+                wait_mode = WAIT_HYBRID;
+            else {
+                fprintf(stderr, "unknown wait mode %s, want block, spin, busypoll or hybrid\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's':
+            spin_us = atoi(optarg);
+            break;
+        case 'c':
+            pin_cpu = atoi(optarg);
+            break;
+        case 'M':
+            if (sscanf(optarg, "%63[^:]:%d", group, &group_port) != 2 ||
+                inet_pton(AF_INET, group, &bcast.group.sin_addr) != 1) {
+                fprintf(stderr, "bad multicast group %s, want group:port\n", optarg);
+                exit(1);
+            }
+            bcast.group.sin_family = AF_INET;
+            bcast.group.sin_port = htons((unsigned short)group_port);
+            break;
+        case 'P':
+            bcast.interval = atof(optarg);
+            break;
+        case 'i':
+            if (inet_pton(AF_INET, optarg, &bcast.iface) != 1) {
+                fprintf(stderr, "bad interface address %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-j threads] [-r rate] [-b burst] [-I] [-K] [-w mode] [-s us] [-c cpu] [-M group:port [-P secs] [-i addr]] <port>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 1 || nthreads < 1 || burst < 1 || spin_us < 0 || bcast.interval < 0.001) {
+        fprintf(stderr, "usage: %s [-j threads] [-r rate] [-b burst] [-I] [-K] [-w mode] [-s us] [-c cpu] [-M group:port [-P secs] [-i addr]] <port>\n", argv[0]);
+        exit(1);
+    }
+    portno = atoi(argv[optind]);
+#ifndef __linux__
+    if (interleaved) {
+        fprintf(stderr, "interleaved mode needs SO_TIMESTAMPING, which is Linux only\n");
+        exit(1);
+    }
+    if (pin_cpu >= 0)
+        fprintf(stderr, "cpu pinning is Linux only, workers left unpinned\n");
+#endif
+#ifndef SO_BUSY_POLL
+    if (wait_mode == WAIT_BUSY_POLL) {
+        fprintf(stderr, "busypoll needs SO_BUSY_POLL, which this system lacks; try hybrid\n");
+        exit(1);
+    }
+#endif
+
+    if (rate > 0) {
+        rate_interval_ns = (uint64_t)(1e9 / rate);
+        rate_tolerance_ns = rate_interval_ns * (uint64_t)(burst - 1);
+    }
+
+#ifdef __linux__
+    // Linux spreads clients across per-worker sockets by address hash
+    reuseport = nthreads > 1;
+#endif
+    worker_arg *args = calloc(nthreads, sizeof(worker_arg));
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    if (args == NULL || threads == NULL)
+        error("ERROR allocating workers");
+    for (i = 0; i < nthreads; i++) {
+        args[i].id = i;
+        args[i].sockfd = (reuseport || i == 0) ? open_socket(portno, reuseport) : args[0].sockfd;
+    }
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, serve, &args[i]) != 0)
+            error("ERROR creating worker thread");
+    }
+    if (group_port != 0) {
+        pthread_t bthread;
+        if (pthread_create(&bthread, NULL, broadcast, &bcast) != 0)
+            error("ERROR creating broadcast thread");
+    }
+    serve(&args[0]);
+    return 0;
+}